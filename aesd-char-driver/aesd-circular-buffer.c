@@ -10,14 +10,30 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <asm/barrier.h>
+#define aesd_load_acquire(p) smp_load_acquire(p)
+#define aesd_store_release(p, v) smp_store_release(p, v)
 #else
 #include <string.h>
+#include <errno.h>
+#define aesd_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define aesd_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
 #endif
 
 #include "aesd-circular-buffer.h"
 
 /**
- * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
+ * @return the entry array index of entry number @param n
+ */
+static inline size_t aesd_circular_buffer_index(const struct aesd_circular_buffer *buffer, size_t n)
+{
+    return n & buffer->mask;
+}
+
+/**
+ * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller,
+ *      except that the consumer of a buffer filled with aesd_circular_buffer_spsc_push() may search it without locking.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
  *      character index if all buffer strings were concatenated end to end
  * @param entry_offset_byte_rtn is a pointer specifying a location to store the byte of the returned aesd_buffer_entry
@@ -29,52 +45,372 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                           size_t char_offset, size_t *entry_offset_byte_rtn)
 {
+    size_t out = buffer->out_offs;
+    size_t in = aesd_load_acquire(&buffer->in_offs);
+    size_t count = in - out;
+    size_t base, last, first, idx;
+
+    if (count == 0)
+        return NULL;
+
+    /**
+     * The end of the newest entry rather than total_size, which an SPSC producer may
+     * have moved past in_offs
+     */
+    base = buffer->entry_pos[aesd_circular_buffer_index(buffer, out)];
+    last = aesd_circular_buffer_index(buffer, in - 1);
+    if (char_offset >= buffer->entry_pos[last] + buffer->entry[last].size - base)
+        return NULL;
+
     /**
-     * TODO: implement per description
+     * Find the last entry starting at or before char_offset.  Empty entries share their
+     * start with the next entry, so the last one found always holds char_offset.
+     * The halving loop has no data dependent branch, which keeps random lookups
+     * free of mispredictions.
      */
-    size_t total_offset = 0;
-    uint8_t idx = buffer->out_offs;
-    size_t count = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : buffer->in_offs;
-
-    for (size_t i = 0; i < count; ++i) {
-        struct aesd_buffer_entry* tmp = &buffer->entry[idx];
-        if (char_offset < total_offset + tmp->size) {
-            *entry_offset_byte_rtn = char_offset - total_offset;
-            return tmp;
+    first = out;
+    while (count > 1) {
+        size_t half = count / 2;
+        size_t mid = first + half;
+        first = buffer->entry_pos[aesd_circular_buffer_index(buffer, mid)] - base <= char_offset ? mid : first;
+        count -= half;
+    }
+
+    idx = aesd_circular_buffer_index(buffer, first);
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_pos[idx] - base);
+    return &buffer->entry[idx];
+}
+
+/**
+ * Removes the oldest entry from @param buffer, clearing its slot and, in arena mode, releasing
+ * its payload space.  @param buffer must not be empty.
+ * @return the removed entry
+ */
+static struct aesd_buffer_entry aesd_circular_buffer_evict(struct aesd_circular_buffer *buffer)
+{
+    size_t oldest = aesd_circular_buffer_index(buffer, buffer->out_offs);
+    struct aesd_buffer_entry evicted = buffer->entry[oldest];
+    size_t next, freed;
+
+    buffer->entry[oldest].buffptr = NULL;
+    buffer->entry[oldest].size = 0;
+    buffer->out_offs++;
+
+    if (buffer->arena) {
+        if (buffer->out_offs == buffer->in_offs) {
+            buffer->arena_head = buffer->arena_tail = buffer->arena_used = 0;
+        } else {
+            /**
+             * Everything up to the next payload is free, including space skipped at the end of
+             * the arena.  The next payload starts where this one did only if this one was empty
+             * or filled the whole arena.
+             */
+            next = buffer->entry[aesd_circular_buffer_index(buffer, buffer->out_offs)].buffptr - buffer->arena;
+            freed = (next + buffer->arena_size - buffer->arena_tail) % buffer->arena_size;
+            if (freed == 0)
+                freed = evicted.size;
+            buffer->arena_tail = next;
+            buffer->arena_used -= freed;
         }
-        total_offset += tmp->size;
-        idx = (idx + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
     }
+    return evicted;
+}
+
+/**
+ * Stores @param add_entry in the slot for buffer->in_offs, overwriting the oldest entry if the
+ * buffer was already full, for aesd_circular_buffer_add_entry() and aesd_circular_buffer_append()
+ * @return the overwritten entry, or an entry with a NULL buffptr if nothing was overwritten
+ */
+static struct aesd_buffer_entry aesd_circular_buffer_store(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry)
+{
+    struct aesd_buffer_entry evicted = { NULL, 0 };
+    size_t idx = aesd_circular_buffer_index(buffer, buffer->in_offs);
 
-    return NULL;
+    if (buffer->in_offs - buffer->out_offs == buffer->capacity)
+        evicted = aesd_circular_buffer_evict(buffer);
+
+    buffer->entry[idx] = *add_entry;
+    buffer->entry_pos[idx] = buffer->total_size;
+    buffer->total_size += add_entry->size;
+    buffer->in_offs++;
+    return evicted;
 }
 
 /**
- * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
+ * Adds entry @param add_entry to @param buffer in the slot for buffer->in_offs.
  * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
  * new start location.
  * Any necessary locking must be handled by the caller
  * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+ * A buffer with an arena only holds payloads copied in by aesd_circular_buffer_append(), since
+ * evicting an entry frees arena space computed from its buffptr, so nothing is added to one.
+ * @return the overwritten entry, so the caller can free its buffptr, or an entry with a NULL
+ *      buffptr if nothing was overwritten or added
  */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry)
 {
-    /**
-     * TODO: implement per description
-     */
-    if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    struct aesd_buffer_entry none = { NULL, 0 };
+
+    if (buffer->arena)
+        return none;
+    return aesd_circular_buffer_store(buffer, add_entry);
+}
+
+/**
+ * Copies the @param size bytes at @param data into the arena of @param buffer and adds them as
+ * the newest entry, evicting the oldest entries until both the entry and its bytes fit.  Evicted
+ * payloads need no freeing, so this does no allocation.
+ * Any necessary locking must be handled by the caller
+ * @return 0, or -EINVAL if @param buffer has no arena or size is larger than the arena
+ */
+int aesd_circular_buffer_append(struct aesd_circular_buffer *buffer, const char *data, size_t size)
+{
+    struct aesd_buffer_entry entry;
+
+    if (!buffer->arena || size > buffer->arena_size)
+        return -EINVAL;
+
+    if (buffer->in_offs - buffer->out_offs == buffer->capacity)
+        aesd_circular_buffer_evict(buffer);
+
+    for (;;) {
+        bool wrapped = buffer->arena_head < buffer->arena_tail ||
+                       (buffer->arena_head == buffer->arena_tail && buffer->arena_used != 0);
+
+        if (!wrapped) {
+            if (size <= buffer->arena_size - buffer->arena_head)
+                break;
+            if (size <= buffer->arena_tail) {
+                /* Skip the end of the arena so the payload stays contiguous */
+                buffer->arena_used += buffer->arena_size - buffer->arena_head;
+                buffer->arena_head = 0;
+                break;
+            }
+        } else if (size <= buffer->arena_tail - buffer->arena_head) {
+            break;
+        }
+        aesd_circular_buffer_evict(buffer);
+    }
+
+    entry.buffptr = buffer->arena + buffer->arena_head;
+    entry.size = size;
+    memcpy(buffer->arena + buffer->arena_head, data, size);
+    buffer->arena_used += size;
+    buffer->arena_head += size;
+    if (buffer->arena_head == buffer->arena_size)
+        buffer->arena_head = 0;
+
+    aesd_circular_buffer_store(buffer, &entry);
+    return 0;
+}
+
+/**
+ * Adds the @param count entries in @param add_entries to @param buffer, oldest first, as if by
+ * calling aesd_circular_buffer_add_entry() on each.  Entries that would be overwritten within
+ * the batch itself are never stored, and each overwritten slot is cleared once.  Overwritten
+ * entries are not returned, so use this when @param buffer does not own the memory entries
+ * point to.  Like aesd_circular_buffer_add_entry(), this adds nothing to a buffer with an arena.
+ * Any necessary locking must be handled by the caller
+ */
+void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count)
+{
+    size_t held = buffer->in_offs - buffer->out_offs;
+    size_t skip = count > buffer->capacity ? count - buffer->capacity : 0;
+    size_t evict = held + count - skip > buffer->capacity ? held + count - skip - buffer->capacity : 0;
+    size_t total = buffer->total_size;
+    size_t in, i;
+
+    if (buffer->arena)
+        return;
+    for (i = 0; i < evict; i++)
+        aesd_circular_buffer_evict(buffer);
+    buffer->out_offs += skip;
+
+    /* Skipped entries still take up their place in the byte stream */
+    for (i = 0; i < skip; i++)
+        total += add_entries[i].size;
+
+    in = buffer->in_offs + skip;
+    for (; i < count; i++, in++) {
+        size_t idx = aesd_circular_buffer_index(buffer, in);
+        buffer->entry[idx] = add_entries[i];
+        buffer->entry_pos[idx] = total;
+        total += add_entries[i].size;
+    }
+    buffer->total_size = total;
+    buffer->in_offs = in;
+}
+
+/**
+ * Describes up to @param len bytes of @param buffer, starting at @param char_offset as for
+ * aesd_circular_buffer_find_entry_offset_for_fpos(), in the iovec array @param iov of
+ * @param iovcnt elements, one element per entry and skipping empty entries, so the caller can
+ * move them with a single writev() or copy loop.
+ * Any necessary locking must be performed by caller, and the entries must not be overwritten
+ * until the caller is done with @param iov.
+ * @param iovcnt_rtn is set to the number of iov elements filled in.
+ * @return the number of bytes described, less than len if the buffer holds fewer bytes past
+ *      char_offset or iov filled up first.
+ */
+size_t aesd_circular_buffer_read_iov(struct aesd_circular_buffer *buffer, size_t char_offset, size_t len,
+            struct iovec *iov, size_t iovcnt, size_t *iovcnt_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    size_t byte, n, in, chunk, used = 0, done = 0;
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &byte);
+    if (entry) {
+        in = aesd_load_acquire(&buffer->in_offs);
+        n = entry - buffer->entry;
+        /* Turn the slot back into an entry number at or after out_offs */
+        n = buffer->out_offs + ((n - buffer->out_offs) & buffer->mask);
+        for (; n != in && done < len && used < iovcnt; n++, byte = 0) {
+            entry = &buffer->entry[aesd_circular_buffer_index(buffer, n)];
+            chunk = entry->size - byte;
+            if (chunk == 0)
+                continue;
+            if (chunk > len - done)
+                chunk = len - done;
+            iov[used].iov_base = (void *)(entry->buffptr + byte);
+            iov[used].iov_len = chunk;
+            used++;
+            done += chunk;
+        }
+    }
+
+    *iovcnt_rtn = used;
+    return done;
+}
+
+/**
+ * Adds entry @param add_entry to @param buffer without locking, for a buffer with one producer
+ * and one consumer thread.  Unlike aesd_circular_buffer_add_entry() this never overwrites:
+ * the consumer takes entries with aesd_circular_buffer_spsc_pop().
+ * Only the producer thread may call this.
+ * @return false, adding nothing, if the buffer already holds buffer->capacity entries
+ */
+bool aesd_circular_buffer_spsc_push(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    size_t in = buffer->in_offs;
+    size_t idx = aesd_circular_buffer_index(buffer, in);
+
+    /* Pairs with the release in spsc_pop(), so the consumer is done with the slot */
+    if (in - aesd_load_acquire(&buffer->out_offs) == buffer->capacity)
+        return false;
+
+    buffer->entry[idx] = *add_entry;
+    buffer->entry_pos[idx] = buffer->total_size;
+    buffer->total_size += add_entry->size;
+    /* Publishes the entry written above */
+    aesd_store_release(&buffer->in_offs, in + 1);
+    return true;
+}
+
+/**
+ * Adds as many of the @param count entries in @param add_entries to @param buffer as fit,
+ * publishing them all at once.  Only the producer thread may call this.
+ * @return the number of entries added, from the start of add_entries
+ */
+size_t aesd_circular_buffer_spsc_push_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count)
+{
+    size_t in = buffer->in_offs;
+    size_t room = buffer->capacity - (in - aesd_load_acquire(&buffer->out_offs));
+    size_t i;
+
+    if (count > room)
+        count = room;
+    for (i = 0; i < count; i++) {
+        size_t idx = aesd_circular_buffer_index(buffer, in + i);
+        buffer->entry[idx] = add_entries[i];
+        buffer->entry_pos[idx] = buffer->total_size;
+        buffer->total_size += add_entries[i].size;
     }
+    aesd_store_release(&buffer->in_offs, in + count);
+    return count;
+}
+
+/**
+ * Removes the oldest entry from @param buffer without locking, copying it to @param entry_rtn.
+ * Only the consumer thread of a buffer filled with aesd_circular_buffer_spsc_push() may call this.
+ * @return false if the buffer is empty
+ */
+bool aesd_circular_buffer_spsc_pop(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry_rtn)
+{
+    size_t out = buffer->out_offs;
+    size_t idx = aesd_circular_buffer_index(buffer, out);
+
+    if (aesd_load_acquire(&buffer->in_offs) == out)
+        return false;
+
+    *entry_rtn = buffer->entry[idx];
+    buffer->entry[idx].buffptr = NULL;
+    buffer->entry[idx].size = 0;
+    /* Hands the slot back to the producer */
+    aesd_store_release(&buffer->out_offs, out + 1);
+    return true;
+}
+
+/**
+ * Makes @param buffer, already initialized and empty, own its payloads in the @param arena_size
+ * bytes at @param arena, which must outlive the buffer.  Add entries with
+ * aesd_circular_buffer_append() from then on.
+ * @return 0, or -EINVAL if arena_size is zero
+ */
+int aesd_circular_buffer_init_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size)
+{
+    if (arena_size == 0)
+        return -EINVAL;
 
-    buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->arena = arena;
+    buffer->arena_size = arena_size;
+    buffer->arena_head = buffer->arena_tail = buffer->arena_used = 0;
+    return 0;
+}
 
-    buffer->full = (buffer->in_offs == buffer->out_offs);
+/**
+ * @return the number of entries held by @param buffer
+ */
+size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return aesd_load_acquire(&buffer->in_offs) - aesd_load_acquire(&buffer->out_offs);
 }
 
 /**
- * Initializes the circular buffer described by @param buffer to an empty struct
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
  */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->entry_store;
+    buffer->entry_pos = buffer->entry_pos_store;
+    buffer->mask = AESDCHAR_DEFAULT_SLOTS - 1;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * Initializes @param buffer to an empty buffer holding up to @param capacity entries in caller
+ * owned storage, which must outlive the buffer.
+ * @param entries and @param entry_pos are arrays of @param slots elements, a power of two of at
+ *      least capacity, for example AESD_CIRCULAR_BUFFER_SLOTS(capacity).
+ * @return 0, or -EINVAL if slots is not a power of two or capacity is zero or above slots
+ */
+int aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, size_t *entry_pos, size_t slots, size_t capacity)
+{
+    if (slots == 0 || (slots & (slots - 1)) != 0 || capacity == 0 || capacity > slots)
+        return -EINVAL;
+
+    aesd_circular_buffer_init(buffer);
+    memset(entries, 0, slots * sizeof(*entries));
+    memset(entry_pos, 0, slots * sizeof(*entry_pos));
+    buffer->entry = entries;
+    buffer->entry_pos = entry_pos;
+    buffer->mask = slots - 1;
+    buffer->capacity = capacity;
+    return 0;
 }
@@ -10,13 +10,17 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/uio.h>
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/uio.h> // struct iovec
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -30,42 +34,118 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/**
+ * Number of entry slots, a power of two, needed to hold @param n entries
+ */
+#define AESD_CIRCULAR_BUFFER_SLOTS(n) \
+    ((n) <= 1 ? 1 : (n) <= 2 ? 2 : (n) <= 4 ? 4 : (n) <= 8 ? 8 : \
+     (n) <= 16 ? 16 : (n) <= 32 ? 32 : (n) <= 64 ? 64 : (n) <= 128 ? 128 : \
+     (n) <= 256 ? 256 : (n) <= 512 ? 512 : (n) <= 1024 ? 1024 : (n) <= 2048 ? 2048 : \
+     (n) <= 4096 ? 4096 : (n) <= 8192 ? 8192 : (n) <= 16384 ? 16384 : (n) <= 32768 ? 32768 : 65536)
+
+#define AESDCHAR_DEFAULT_SLOTS AESD_CIRCULAR_BUFFER_SLOTS(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Has mask + 1 slots; entry n lives in slot n & mask.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Position of the first byte of each entry in the stream of every byte ever added,
+     * so a lookup can binary search these instead of summing entry sizes.
+     * Positions may wrap around; only differences between them are meaningful.
+     */
+    size_t *entry_pos;
+    /**
+     * Number of slots minus one, the slot count being a power of two
+     */
+    size_t mask;
+    /**
+     * Most entries held at once, at most mask + 1.  Adding to a buffer holding this
+     * many entries overwrites the oldest one.
+     */
+    size_t capacity;
+    /**
+     * Total number of bytes ever added, which is the position of the next entry
+     */
+    size_t total_size;
+    /**
+     * Number of entries ever added.  The next write is stored in slot in_offs & mask.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t in_offs;
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * Number of entries ever removed or overwritten.  The oldest entry is in slot
+     * out_offs & mask, and in_offs - out_offs entries are held.
      */
-    uint8_t in_offs;
+    size_t out_offs;
     /**
-     * The first location in the entry structure to read from
+     * Payload memory owned by the buffer after aesd_circular_buffer_init_arena(), or NULL when
+     * callers own the memory entries point to.  aesd_circular_buffer_append() copies each payload
+     * to arena_head, wrapping to the start of the arena when it does not fit before the end.
      */
-    uint8_t out_offs;
+    char *arena;
+    size_t arena_size;
     /**
-     * set to true when the buffer entry structure is full
+     * Arena offset where the next payload goes
      */
-    bool full;
+    size_t arena_head;
+    /**
+     * Arena offset of the oldest entry's payload
+     */
+    size_t arena_tail;
+    /**
+     * Bytes from arena_tail to arena_head, including any left unused at the end of the arena
+     * when a payload wrapped
+     */
+    size_t arena_used;
+    /**
+     * Slots used by aesd_circular_buffer_init(), which holds
+     * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+     */
+    struct aesd_buffer_entry entry_store[AESDCHAR_DEFAULT_SLOTS];
+    size_t entry_pos_store[AESDCHAR_DEFAULT_SLOTS];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry);
+
+extern void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count);
+
+extern size_t aesd_circular_buffer_read_iov(struct aesd_circular_buffer *buffer, size_t char_offset, size_t len,
+            struct iovec *iov, size_t iovcnt, size_t *iovcnt_rtn);
+
+extern int aesd_circular_buffer_append(struct aesd_circular_buffer *buffer, const char *data, size_t size);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, size_t *entry_pos, size_t slots, size_t capacity);
+
+extern int aesd_circular_buffer_init_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size);
+
+extern size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_spsc_push(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern size_t aesd_circular_buffer_spsc_push_entries(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entries, size_t count);
+
+extern bool aesd_circular_buffer_spsc_pop(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +154,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -1,10 +1,21 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include "fcntl.h"
 #include "stdlib.h"
 #include "unistd.h"
+#include <errno.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -29,6 +40,75 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * Start @param command with posix_spawn(), stdout going to @param outputfile unless it is NULL.
+ * posix_spawn() shares the parent's memory until the exec instead of copying its page tables
+ * as fork() does, so the cost does not grow with the size of the caller's heap, and the
+ * redirection is a file action run only in the child.
+ * @param fds - If not NULL, descriptors to become the child's stdin, stdout and stderr, or -1
+ *   to inherit the parent's.  They should be close-on-exec so other children do not hold them.
+ * @return true if the child was started and *pid set, false if the spawn or the exec failed
+ */
+static bool spawn_command(char *const command[], const char *outputfile, const int fds[3], pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    int rc, i;
+
+    /* The posix_spawn functions return an error number rather than setting errno */
+    rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "posix_spawn_file_actions_init failed: %s\n", strerror(rc));
+        return false;
+    }
+    if (outputfile) {
+        rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                              O_WRONLY | O_TRUNC | O_CREAT, 0644);
+        if (rc != 0) {
+            fprintf(stderr, "posix_spawn_file_actions_addopen failed: %s\n", strerror(rc));
+            posix_spawn_file_actions_destroy(&actions);
+            return false;
+        }
+    }
+    for (i = 0; fds && i < 3; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        rc = posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+        if (rc != 0) {
+            fprintf(stderr, "posix_spawn_file_actions_adddup2 failed: %s\n", strerror(rc));
+            posix_spawn_file_actions_destroy(&actions);
+            return false;
+        }
+    }
+
+    fflush(stdout);
+    rc = posix_spawn(pid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "posix_spawn %s failed: %s\n", command[0], strerror(rc));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for the child @param pid
+ * @return true if it exited with status 0
+ */
+static bool wait_command(pid_t pid)
+{
+    siginfo_t info;
+
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_PID, pid, &info, WEXITED) == -1) {
+        if (errno != EINTR) {
+            perror("wait failed");
+            return false;
+        }
+    }
+    return info.si_code == CLD_EXITED && info.si_status == 0;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -38,8 +118,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   spawn or wait, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -54,58 +134,174 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
+    va_end(args);
 
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
+    pid_t pid;
+    if (!spawn_command(command, NULL, NULL, &pid)) {
+        return false;
+    }
+    return wait_command(pid);
+}
+
+/**
+* @param outputfile - The full path to the file to write with command output.
+*   This file will be closed at completion of the function call.
+* All other parameters, see do_exec above
 */
-    fflush(stdout);
-    pid_t pid = fork();
-    if (pid == 0) {
-        /* Call execv for child process */
-        fprintf(stderr, "Debug: command[0] = %s\n", command[0] ? command[0] : "NULL");
-        if (execv(command[0], command) == -1) {
-            perror("execv failed");
-            exit(EXIT_FAILURE);
-        }
-    }
-    else if (pid < 0) {
-        perror("fork failed");
-        va_end(args);
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    /* The file is opened by the child only, so the parent never holds it */
+    pid_t pid;
+    if (!spawn_command(command, outputfile, NULL, &pid)) {
         return false;
     }
+    return wait_command(pid);
+}
 
-    /* Handle parent process */
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        perror("wait failed");
-        va_end(args);
+/**
+* @param count - The number of commands in @param commands
+* @param commands - NULL terminated argument vectors, each starting with the full path of
+*   the command as for do_exec()
+* @param results - If not NULL, results[i] is set to whether commands[i] started and exited
+*   with status 0
+* All commands are started before any is waited for, so they run concurrently; they are then
+* reaped in a single waitid() loop.
+* @return true if every command was executed successfully
+*/
+bool do_exec_batch(size_t count, char *const *commands[], bool *results)
+{
+    pid_t *pids = malloc(count * sizeof(pid_t));
+    bool all_ok = true;
+    size_t i;
+
+    if (!pids && count > 0) {
+        perror("malloc failed");
         return false;
     }
 
-    va_end(args);
+    for (i = 0; i < count; i++) {
+        if (!spawn_command(commands[i], NULL, NULL, &pids[i])) {
+            pids[i] = -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        bool ok = pids[i] != -1 && wait_command(pids[i]);
+        if (results) {
+            results[i] = ok;
+        }
+        all_ok = all_ok && ok;
+    }
+
+    free(pids);
+    return all_ok;
+}
+
+/**
+ * Read what is available on @param fd into @param out, growing it as needed
+ * @return the number of bytes read, 0 at end of file, or -1 on error
+ */
+static ssize_t read_output(struct exec_output *out, int fd)
+{
+    ssize_t n;
 
-    /* This condition ensures that only return true if the child process terminated successfully */
-    /* Normally, the test case failed */
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        return true;
+    /* Keep room for the terminating NUL */
+    if (out->capacity - out->len < 2) {
+        size_t capacity = out->capacity < 4096 ? 4096 : out->capacity * 2;
+        char *data = realloc(out->data, capacity);
+        if (!data) {
+            perror("realloc failed");
+            return -1;
+        }
+        out->data = data;
+        out->capacity = capacity;
     }
-    return false;
+    do {
+        n = read(fd, out->data + out->len, out->capacity - out->len - 1);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        out->len += n;
+    }
+    out->data[out->len] = '\0';
+    return n;
 }
 
 /**
-* @param outputfile - The full path to the file to write with command output.
-*   This file will be closed at completion of the function call.
+ * Read the pipes in @param fds into the matching buffers in @param outs until all reach end of
+ * file, closing them.  Unused entries are -1.  Reading both with poll() means a child blocked
+ * writing to one pipe cannot deadlock the parent waiting on the other.
+ * @return true if everything was read
+ */
+static bool capture_output(struct exec_output *outs[2], int fds[2])
+{
+    bool ok = true;
+    int i;
+
+    while (fds[0] >= 0 || fds[1] >= 0) {
+        struct pollfd pfds[2] = { { fds[0], POLLIN, 0 }, { fds[1], POLLIN, 0 } };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            ok = false;
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            ssize_t n;
+            if (fds[i] < 0 || !pfds[i].revents) {
+                continue;
+            }
+            n = read_output(outs[i], fds[i]);
+            if (n <= 0) {
+                ok = ok && n == 0;
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return ok;
+}
+
+/**
+ * Create a close-on-exec pipe for capturing into @param out, leaving -1 in both ends when
+ * out is NULL
+ * @return true on success
+ */
+static bool capture_pipe(struct exec_output *out, int fds[2])
+{
+    fds[0] = fds[1] = -1;
+    if (out && pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return false;
+    }
+    return true;
+}
+
+/**
+* @param out - If not NULL, the command's stdout is appended to this buffer instead of being
+*   inherited
+* @param err - If not NULL, the command's stderr is appended to this buffer
 * All other parameters, see do_exec above
+* @return true if the command was executed successfully, as for do_exec(), and all of its
+*   output was captured
 */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+bool do_exec_capture(struct exec_output *out, struct exec_output *err, int count, ...)
 {
     va_list args;
     va_start(args, count);
@@ -116,60 +312,210 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
+    va_end(args);
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
+    struct exec_output *outs[2] = { out, err };
+    int out_pipe[2], err_pipe[2];
+    if (!capture_pipe(out, out_pipe)) {
+        return false;
+    }
+    if (!capture_pipe(err, err_pipe)) {
+        if (out) {
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }
+        return false;
+    }
+
+    int child_fds[3] = { -1, out_pipe[1], err_pipe[1] };
+    int read_fds[2] = { out_pipe[0], err_pipe[0] };
+    pid_t pid;
+    bool started = spawn_command(command, NULL, child_fds, &pid);
+
+    /* Only the child may hold the write ends, so the reads see end of file when it exits */
+    for (i = 1; i < 3; i++) {
+        if (child_fds[i] >= 0) {
+            close(child_fds[i]);
+        }
+    }
+    bool captured = capture_output(outs, read_fds);
+    if (!started) {
+        return false;
+    }
+    return wait_command(pid) && captured;
+}
+
+/**
+* @param out - If not NULL, the last command's stdout is appended to this buffer instead of
+*   being inherited
+* @param count - The number of commands in @param commands
+* @param commands - NULL terminated argument vectors, each starting with the full path of
+*   the command as for do_exec()
+* Runs commands[0] | commands[1] | ... directly, connected by pipes, without a shell.
+* @return true if every command in the pipeline was executed successfully, false for an
+*   empty pipeline
 */
-    fflush(stdout);
-    int pid = fork();
-    int fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("open failed");
-        exit(EXIT_FAILURE);
-    }
-
-    /* Check pid and call execv */
-    switch (pid) {
-        case -1:
-            perror("fork failed");
-            exit(EXIT_FAILURE);
-            break;
-        case 0:
-            if (dup2(fd, 1) < 0) {
-                perror("dup2 failed");
-                exit(EXIT_FAILURE);
+bool do_exec_pipeline(struct exec_output *out, size_t count, char *const *commands[])
+{
+    pid_t *pids;
+    struct exec_output *outs[2] = { out, NULL };
+    int capture[2], read_fds[2] = { -1, -1 };
+    int prev_read = -1;
+    bool ok = true;
+    size_t i;
+
+    /* No command would take the capture pipe's write end, so reading it would never end */
+    if (count == 0) {
+        return false;
+    }
+    pids = malloc(count * sizeof(pid_t));
+    if (!pids) {
+        perror("malloc failed");
+        return false;
+    }
+    if (!capture_pipe(out, capture)) {
+        free(pids);
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        int next[2] = { -1, -1 };
+        int child_fds[3] = { prev_read, -1, -1 };
+
+        if (i + 1 < count) {
+            if (pipe2(next, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                ok = false;
             }
-            close(fd);
-            if (execv(command[0], command) == -1) {
-                perror("execv failed");
-                exit(EXIT_FAILURE);
+            child_fds[1] = next[1];
+        } else {
+            child_fds[1] = capture[1];
+        }
+        /*
+         * After a failure the rest are not started; closing the pipe ends below lets the
+         * commands already running see end of file or EPIPE, so nothing waits forever
+         */
+        if (!ok || !spawn_command(commands[i], NULL, child_fds, &pids[i])) {
+            pids[i] = -1;
+            ok = false;
+        }
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (child_fds[1] >= 0) {
+            close(child_fds[1]);
+        }
+        prev_read = next[0];
+    }
+
+    read_fds[0] = capture[0];
+    if (!capture_output(outs, read_fds)) {
+        ok = false;
+    }
+    for (i = 0; i < count; i++) {
+        if (pids[i] == -1 || !wait_command(pids[i])) {
+            ok = false;
+        }
+    }
+
+    free(pids);
+    return ok;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Wait up to @param timeout_ms for the child @param pid to exit, returning once it has or the
+ * time is up, without reaping it.  Uses a pidfd where the kernel has them, polling otherwise.
+ * @return true if the child exited in time
+ */
+static bool wait_deadline(pid_t pid, int timeout_ms, const struct timespec *start)
+{
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    siginfo_t info;
+
+    for (;;) {
+        int left = timeout_ms - (int)(elapsed_seconds(start) * 1000);
+        if (left < 0) {
+            left = 0;
+        }
+        if (pidfd >= 0) {
+            struct pollfd pfd = { pidfd, POLLIN, 0 };
+            int n = poll(&pfd, 1, left);
+            if (n == -1 && errno == EINTR) {
+                continue;
             }
-            break;
-        default:
-            close(fd);
-            break;
+            close(pidfd);
+            return n == 1;
+        }
+        /* No pidfd_open(): check every 10ms */
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+            return true;
+        }
+        if (left == 0) {
+            return false;
+        }
+        usleep(left < 10 ? left * 1000 : 10000);
+    }
+}
+
+/**
+* @param timeout_ms - Kill the command with SIGKILL if it has not exited after this many
+*   milliseconds; a negative value waits indefinitely as do_exec() does
+* @param usage - If not NULL, filled with the command's wall time, CPU time and peak memory,
+*   and whether it was killed for running out of time
+* All other parameters, see do_exec above
+* @return true if the command was executed successfully within the deadline
+*/
+bool do_exec_timeout(int timeout_ms, struct exec_usage *usage, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
     }
-    
-    /* Handle parent process */
+    command[count] = NULL;
+    va_end(args);
+
+    struct timespec start;
+    struct rusage ru;
+    bool timed_out = false;
     int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        perror("wait failed");
-        va_end(args);
+    pid_t pid;
+
+    if (usage) {
+        memset(usage, 0, sizeof(*usage));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!spawn_command(command, NULL, NULL, &pid)) {
         return false;
     }
+    if (timeout_ms >= 0 && !wait_deadline(pid, timeout_ms, &start)) {
+        kill(pid, SIGKILL);
+        timed_out = true;
+    }
+    while (wait4(pid, &status, 0, &ru) == -1) {
+        if (errno != EINTR) {
+            perror("wait failed");
+            return false;
+        }
+    }
 
-    va_end(args);
-
-    /* This condition ensures that only return true if the child process terminated successfully */
-    /* Normally, the test case failed */
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        return true;
+    if (usage) {
+        usage->wall_seconds = elapsed_seconds(&start);
+        usage->user_seconds = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        usage->system_seconds = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        usage->max_rss_kb = ru.ru_maxrss;
+        usage->timed_out = timed_out;
     }
-    return false;
+    return !timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
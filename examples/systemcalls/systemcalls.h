@@ -7,3 +7,39 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+bool do_exec_batch(size_t count, char *const *commands[], bool *results);
+
+/**
+ * Growable buffer the output of a command is captured into.  Start with it zeroed, or with
+ * data from malloc() and its capacity.  data is realloc()ed as needed, kept NUL terminated,
+ * and must be freed by the caller.
+ */
+struct exec_output {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+bool do_exec_capture(struct exec_output *out, struct exec_output *err, int count, ...);
+
+bool do_exec_pipeline(struct exec_output *out, size_t count, char *const *commands[]);
+
+/**
+ * Resource use of a command run by do_exec_timeout()
+ */
+struct exec_usage {
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    /**
+     * Peak resident set size in kilobytes
+     */
+    long max_rss_kb;
+    /**
+     * Set if the command was killed for running past its deadline
+     */
+    bool timed_out;
+};
+
+bool do_exec_timeout(int timeout_ms, struct exec_usage *usage, int count, ...);
@@ -22,6 +22,18 @@ fi
 FILESDIR=$1
 SEARCHSTR=$2
 
+# The native finder walks the tree once in parallel; it matches literally, so
+# leave search strings with regular expression characters to grep
+FINDER="$(dirname "$0")/finder"
+case "$SEARCHSTR" in
+    *[].[*^\$\\]*) ;;
+    *)
+        if [ -x "$FINDER" ]; then
+            exec "$FINDER" "$FILESDIR" "$SEARCHSTR"
+        fi
+        ;;
+esac
+
 # Count the number of files in $1
 NUM_FILES=$(find "$FILESDIR" -type f | wc -l)
 
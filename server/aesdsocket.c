@@ -14,33 +14,57 @@
 #include <sys/queue.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "framer.h"
+#include "log.h"
+#include "stats.h"
+#include "lz4block.h"
 
 // Threaded client struct
 struct client {
     int client_fd;
     pthread_t thread;
-    bool complete;
+    atomic_bool complete;
     SLIST_ENTRY(client) entries;
 };
 
 SLIST_HEAD(client_list, client);
 struct client_list client_head = SLIST_HEAD_INITIALIZER(client_head);
-
-#define PORT 9000
-#define BACKLOG 10
-#define DATA_FILE "/var/tmp/aesdsocketdata"
+// Orders closing a client's fd against shutting it down from close_clients()
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int server_fd = -1;
 int data_fd = -1;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int wake_fd = -1;
 volatile sig_atomic_t running = 1;
+const struct store_ops *store = &file_store_ops;
+// -k: leave DATA_FILE and its index for the next start
+static bool keep_history;
+
+enum engine {
+    ENGINE_THREAD,
+    ENGINE_POOL,
+    ENGINE_EPOLL,
+    ENGINE_URING,
+};
 
 // Cleanup resources
 void cleanup() {
     syslog(LOG_INFO, "Shutting down server ...");
     if (server_fd >= 0) close(server_fd);
-    if (data_fd >= 0) close(data_fd);
-    unlink(DATA_FILE);
+    stats_stop();
+    log_stop();
+    store->close();
+    if (wake_fd >= 0) close(wake_fd);
+    if (!keep_history) {
+        unlink(DATA_FILE);
+        unlink(INDEX_FILE);
+    }
     closelog();
 }
 
@@ -48,81 +72,458 @@ void cleanup() {
 void handle_signal(int sig) {
     running = 0;
     shutdown(server_fd, SHUT_RDWR);
+    if (wake_fd >= 0) eventfd_write(wake_fd, 1);
 }
 
-// Thread handler
-void* client_handler(void* arg) {
-    struct client* client = (struct client*)arg;
-    char buffer[1024];
-    ssize_t rcv_len;
-    bool packet_done = false;
+// SIGUSR1 asks the stats thread to dump the counters to syslog
+void handle_stats_signal(int sig) {
+    stats_request_dump();
+}
+
+// Create and bind a TCP socket on PORT
+int open_listener(bool reuseport) {
+    struct sockaddr_in srv_addr = {0};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Socket failed");
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuseport) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
 
-    sleep(1);
-    syslog(LOG_INFO, "thread started: client_fd = %d", client->client_fd);
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_addr.s_addr = INADDR_ANY;
+    srv_addr.sin_port = htons(PORT);
 
-    while ((rcv_len = recv(client->client_fd, buffer, sizeof(buffer), 0)) > 0) {
-        pthread_mutex_lock(&mutex);
-        if (write(data_fd, buffer, rcv_len) != rcv_len) {
-            syslog(LOG_ERR, "Write failed");
+    if (bind(fd, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) < 0) {
+        syslog(LOG_ERR, "Bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void log_send_failure(int err) {
+    if (err == EPIPE || err == ECONNRESET) {
+        log_event(LOG_INFO, "Client closed the connection during a reply");
+    } else {
+        log_event(LOG_ERR, "Send failed: %s", strerror(err));
+    }
+}
+
+// Send the history range [off, end) on a blocking socket
+static int send_reply(int client_fd, size_t off, size_t end) {
+    while (off < end) {
+        ssize_t sent = store->send(client_fd, off, end);
+        if (sent <= 0) {
+            log_send_failure(sent < 0 ? errno : EPIPE);
+            return -1;
         }
-        pthread_mutex_unlock(&mutex);
-        if (memchr(buffer, '\n', rcv_len)) {
-            packet_done = true;
-            break;
+        off += sent;
+        stats_add(STAT_BYTES_OUT, sent);
+    }
+    return 0;
+}
+
+// Parse a decimal number at *p, leaving *p on the first byte after it
+static bool parse_size(const char **p, const char *end, size_t *val) {
+    const char *s = *p;
+    size_t v = 0;
+
+    if (s == end || *s < '0' || *s > '9') return false;
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        if (v > (SIZE_MAX - 9) / 10) return false;
+        v = v * 10 + (*s - '0');
+    }
+    *p = s;
+    *val = v;
+    return true;
+}
+
+int commit_packet(const char *pkt, size_t len, size_t *start, size_t *end, bool *compress, bool nonblock) {
+    const char *p, *last = pkt + len - 1;
+    size_t seek_len = strlen(SEEK_CMD), from_len = strlen(READFROM_CMD);
+    size_t compress_len = strlen(COMPRESS_CMD);
+    size_t packet, byte, pos, mode;
+
+    if (len > seek_len && memcmp(pkt, SEEK_CMD, seek_len) == 0) {
+        p = pkt + seek_len;
+        if (!parse_size(&p, last, &packet) || p == last || *p++ != ',' ||
+            !parse_size(&p, last, &byte) || p != last) {
+            log_event(LOG_ERR, "Malformed seek command");
+            *start = *end = store->snapshot();
+            return 0;
+        }
+        if (!store->seek) {
+            log_event(LOG_ERR, "The %s store cannot seek", store->name);
+            *start = *end = store->snapshot();
+            return 0;
         }
+        if (store->seek(packet, byte, &pos) < 0) {
+            log_event(LOG_ERR, "Seek to packet %zu byte %zu failed", packet, byte);
+            *start = *end = store->snapshot();
+            return 0;
+        }
+        *end = store->snapshot();
+        *start = pos;
+        return 0;
     }
 
-    if (rcv_len < 0) {
-        syslog(LOG_ERR, "Receive failed");
+    if (len > from_len && memcmp(pkt, READFROM_CMD, from_len) == 0) {
+        p = pkt + from_len;
+        *end = store->snapshot();
+        if (!parse_size(&p, last, &pos) || p != last) {
+            log_event(LOG_ERR, "Malformed read command");
+            pos = *end;
+        }
+        *start = pos < *end ? pos : *end;
+        return 0;
     }
 
-    if (packet_done) {
-        pthread_mutex_lock(&mutex);
-        lseek(data_fd, 0, SEEK_SET);
-        while ((rcv_len = read(data_fd, buffer, sizeof(buffer))) > 0) {
-            if (send(client->client_fd, buffer, rcv_len, 0) != rcv_len) {
-                syslog(LOG_ERR, "Send failed");
-                break;
+    if (len > compress_len && memcmp(pkt, COMPRESS_CMD, compress_len) == 0) {
+        p = pkt + compress_len;
+        if (!parse_size(&p, last, &mode) || p != last || mode > 1) {
+            log_event(LOG_ERR, "Malformed compress command");
+        } else {
+            *compress = mode == 1;
+        }
+        *start = *end = store->snapshot();
+        return 0;
+    }
+
+    *start = 0;
+    if (nonblock && store->append_async) {
+        return store->append_async(pkt, len, end) < 0 ? -1 : 1;
+    }
+    return store->append(pkt, len, end);
+}
+
+static void put_le32(char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+int compress_reply(struct zreply *z, size_t off, size_t end) {
+    size_t frame_max = ZFRAME_HEADER + LZ4_BLOCK_BOUND(LZ_BLOCK);
+
+    if (!z->raw && !(z->raw = malloc(LZ_BLOCK))) return -1;
+    z->len = z->sent = 0;
+
+    do {
+        const char *data;
+        size_t raw_len, comp_len;
+
+        if (z->cap - z->len < frame_max) {
+            size_t cap = z->cap ? z->cap * 2 : 4 * frame_max;
+            char *buf = realloc(z->buf, cap);
+            if (!buf) return -1;
+            z->buf = buf;
+            z->cap = cap;
+        }
+        char *frame = z->buf + z->len;
+
+        if (store->block && off < end && store->block(off, &data, &raw_len, &comp_len) == 0 &&
+            raw_len <= end - off) {
+            // Blocks the store already keeps compressed go out as they are
+            memcpy(frame + ZFRAME_HEADER, data, comp_len ? comp_len : raw_len);
+            off += raw_len;
+        } else {
+            ssize_t got = 0;
+
+            // A bounded store may skip dropped history without copying anything
+            while (got == 0 && off < end) {
+                size_t from = off, want = LZ_BLOCK - off % LZ_BLOCK;
+                if (want > end - off) want = end - off;
+                got = store->read(z->raw, &off, want);
+                if (got < 0 || (got == 0 && off == from)) return -1;
             }
+            off += got;
+            raw_len = got;
+            comp_len = raw_len ? lz4_compress_block(z->raw, raw_len, frame + ZFRAME_HEADER,
+                                                    LZ4_BLOCK_BOUND(LZ_BLOCK)) : 0;
+            if (comp_len >= raw_len) {
+                comp_len = 0;
+                memcpy(frame + ZFRAME_HEADER, z->raw, raw_len);
+            }
+        }
+        put_le32(frame, raw_len | (off == end ? ZFRAME_LAST : 0));
+        put_le32(frame + 4, comp_len);
+        z->len += ZFRAME_HEADER + (comp_len ? comp_len : raw_len);
+    } while (off < end);
+    return 0;
+}
+
+void zreply_release(struct zreply *z) {
+    free(z->buf);
+    free(z->raw);
+    z->buf = z->raw = NULL;
+    z->len = z->cap = z->sent = 0;
+}
+
+// Send the compressed form of the history range [off, end) on a blocking socket
+static int send_compressed(int client_fd, struct zreply *z, size_t off, size_t end) {
+    if (compress_reply(z, off, end) < 0) {
+        log_event(LOG_ERR, "Compressing reply failed");
+        return -1;
+    }
+    while (z->sent < z->len) {
+        ssize_t sent = send(client_fd, z->buf + z->sent, z->len - z->sent, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            log_send_failure(sent < 0 ? errno : EPIPE);
+            return -1;
         }
-        pthread_mutex_unlock(&mutex);
+        z->sent += sent;
+        stats_add(STAT_BYTES_OUT, sent);
     }
+    return 0;
+}
+
+void session_open(struct session *s, int fd) {
+    s->fd = fd;
+    s->compress = false;
+    s->z = (struct zreply){0};
+    framer_init(&s->in);
+    if (store->attach) store->attach(fd);
+    stats_add(STAT_CONNECTIONS, 1);
+}
+
+int session_reply(struct session *s) {
+    const char *pkt;
+    size_t pkt_len;
+    size_t reply_off, reply_end;
+
+    while (framer_next(&s->in, &pkt, &pkt_len)) {
+        uint64_t started = stats_now();
+        bool failed = commit_packet(pkt, pkt_len, &reply_off, &reply_end, &s->compress, false) < 0 ||
+                      (s->compress ? send_compressed(s->fd, &s->z, reply_off, reply_end)
+                                   : send_reply(s->fd, reply_off, reply_end)) < 0;
+        stats_add(STAT_PACKETS, 1);
+        if (failed) return -1;
+        stats_reply_done(started);
+    }
+    return 0;
+}
+
+ssize_t session_recv(struct session *s, int flags) {
+    size_t avail;
+    char *space = framer_space(&s->in, &avail);
+    if (!space) {
+        log_event(LOG_ERR, "Receive buffer allocation failed");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t rcv_len = recv(s->fd, space, avail, flags);
+    if (rcv_len > 0) {
+        stats_add(STAT_BYTES_IN, rcv_len);
+        framer_fill(&s->in, rcv_len);
+    } else if (rcv_len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_event(LOG_ERR, "Receive failed");
+    }
+    return rcv_len;
+}
+
+void session_release(struct session *s) {
+    framer_release(&s->in);
+    zreply_release(&s->z);
+    log_event(LOG_INFO, "Close connection on fd %d", s->fd);
+}
+
+// Append each received packet and reply with the history until the client closes
+void serve_client(int client_fd) {
+    struct session s;
+
+    session_open(&s, client_fd);
+    while (session_reply(&s) == 0 && session_recv(&s, 0) > 0) {
+    }
+    session_release(&s);
+}
+
+// Thread handler
+void* client_handler(void* arg) {
+    struct client* client = (struct client*)arg;
 
+    log_event(LOG_INFO, "thread started: client_fd = %d", client->client_fd);
+    serve_client(client->client_fd);
+    pthread_mutex_lock(&clients_lock);
     close(client->client_fd);
-    syslog(LOG_INFO, "Close connection on fd %d", client->client_fd);
-    client->complete = true;
+    atomic_store(&client->complete, true);
+    pthread_mutex_unlock(&clients_lock);
     pthread_exit(NULL);
 }
 
+// Unblock every client thread still serving, so shutdown does not wait for clients to leave
+static void close_clients(void) {
+    struct client *cp;
+
+    pthread_mutex_lock(&clients_lock);
+    SLIST_FOREACH(cp, &client_head, entries) {
+        if (!atomic_load(&cp->complete)) shutdown(cp->client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+// Join and free finished client threads, or all of them when wait_all is set
+void reap_clients(bool wait_all) {
+    struct client **link = &SLIST_FIRST(&client_head);
+
+    while (*link) {
+        struct client *cp = *link;
+        if (!wait_all && !atomic_load(&cp->complete)) {
+            link = &SLIST_NEXT(cp, entries);
+            continue;
+        }
+        pthread_join(cp->thread, NULL);
+        *link = SLIST_NEXT(cp, entries);
+        free(cp);
+    }
+}
+
 int main(int argc, char* argv[]) {
     int daemon_mode = 0;
+    enum engine engine = ENGINE_THREAD;
+    int count = -1;
+    int queue_depth = 64;
+    struct store_config store_cfg = {0};
+    enum log_mode log_mode = LOG_MODE_SYNC;
+    bool stats_socket = false;
     int opt;
 
-    while ((opt = getopt(argc, argv, "d")) != -1) {
-        if (opt == 'd') daemon_mode = 1;
+    // -m selects the connection engine, -n the number of epoll reactors or
+    // pool workers, -q the pool queue depth, -s the history store, -p enables
+    // write-behind for the memory store and -z replies with sendfile()/splice()
+    // or MSG_ZEROCOPY, -l moves per-connection logging off the request path
+    // and -S serves the counters on STATS_SOCKET; -N and -B bound the packets
+    // and bytes the ring store keeps, -w sets the wal store's commit interval
+    // and -k keeps the file store's history across restarts
+    while ((opt = getopt(argc, argv, "B:dkl:m:n:N:pq:s:Sw:z")) != -1) {
+        switch (opt) {
+            case 'B':
+                store_cfg.ring_bytes = strtoul(optarg, NULL, 0);
+                if (store_cfg.ring_bytes == 0) {
+                    fprintf(stderr, "History size must be at least one byte\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'k':
+                keep_history = true;
+                store_cfg.keep_history = true;
+                break;
+            case 'l':
+                if (strcmp(optarg, "sync") == 0) {
+                    log_mode = LOG_MODE_SYNC;
+                } else if (strcmp(optarg, "async") == 0) {
+                    log_mode = LOG_MODE_ASYNC;
+                } else if (strcmp(optarg, "quiet") == 0) {
+                    log_mode = LOG_MODE_QUIET;
+                } else {
+                    fprintf(stderr, "Unknown log mode '%s', expected sync, async or quiet\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    engine = ENGINE_POOL;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    engine = ENGINE_THREAD;
+                } else {
+                    fprintf(stderr, "Unknown mode '%s', expected thread, pool, epoll or uring\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'N':
+                store_cfg.ring_packets = strtoul(optarg, NULL, 0);
+                if (store_cfg.ring_packets == 0 || store_cfg.ring_packets > RING_MAX_PACKETS) {
+                    fprintf(stderr, "History must keep between 1 and %d packets\n", RING_MAX_PACKETS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                if (queue_depth < 1) queue_depth = 1;
+                break;
+            case 'p':
+                store_cfg.persist = true;
+                break;
+            case 's':
+                if (strcmp(optarg, "mem") == 0) {
+                    store = &mem_store_ops;
+                } else if (strcmp(optarg, "file") == 0) {
+                    store = &file_store_ops;
+                } else if (strcmp(optarg, "ring") == 0) {
+                    store = &ring_store_ops;
+                } else if (strcmp(optarg, "wal") == 0) {
+                    store = &wal_store_ops;
+                } else if (strcmp(optarg, "lz") == 0) {
+                    store = &lz_store_ops;
+                } else {
+                    fprintf(stderr, "Unknown store '%s', expected file, mem, ring, wal or lz\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S':
+                stats_socket = true;
+                break;
+            case 'w':
+                store_cfg.wal_interval_us = strtol(optarg, NULL, 0);
+                if (store_cfg.wal_interval_us < 0 || store_cfg.wal_interval_us > 1000000) {
+                    fprintf(stderr, "Commit interval must be between 0 and 1000000 microseconds\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'z':
+                store_cfg.zerocopy = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-m thread|pool|epoll|uring] [-n count] [-q depth] [-s file|mem|ring|wal|lz] [-N packets] [-B bytes] [-w usec] [-k] [-p] [-z] [-l sync|async|quiet] [-S]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
     }
 
+    // Only the file store reads DATA_FILE back at startup; the wal store always keeps its log
+    if (keep_history && store != &file_store_ops) {
+        fprintf(stderr, "Keeping history across restarts needs the file store\n");
+        return EXIT_FAILURE;
+    }
+
+    // Pools default to one worker per core, epoll to a single reactor
+    if (count == 0 || (count < 0 && engine == ENGINE_POOL)) {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count < 1) count = 1;
+
     openlog("aesdsocket", LOG_PID, LOG_USER);
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
 
-    struct sockaddr_in srv_addr = {0};
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        syslog(LOG_ERR, "Socket failed");
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        syslog(LOG_ERR, "eventfd failed");
         cleanup();
         return EXIT_FAILURE;
     }
 
-    int reuse = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_addr.s_addr = INADDR_ANY;
-    srv_addr.sin_port = htons(PORT);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    // sendfile() and splice() take no MSG_NOSIGNAL; a client resetting mid-reply must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-    if (bind(server_fd, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) < 0) {
-        syslog(LOG_ERR, "Bind failed");
+    server_fd = open_listener(engine == ENGINE_EPOLL && count > 1);
+    if (server_fd < 0) {
         cleanup();
         return EXIT_FAILURE;
     }
@@ -152,9 +553,35 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    data_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (data_fd < 0) {
-        syslog(LOG_ERR, "Failed to open data file");
+    if (store->open(&store_cfg) < 0) {
+        cleanup();
+        return EXIT_FAILURE;
+    }
+
+    // Threads do not survive the daemon fork, so start the helpers only now
+    log_start(log_mode);
+    if (stats_start(stats_socket) < 0) {
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    signal(SIGUSR1, handle_stats_signal);
+
+    if (engine == ENGINE_EPOLL) {
+        int rc = run_reactors(count);
+        cleanup();
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (engine == ENGINE_URING) {
+        int rc = run_uring();
+        if (rc <= 0) {
+            cleanup();
+            return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        engine = ENGINE_THREAD;
+    }
+
+    if (engine == ENGINE_POOL && pool_start(count, queue_depth) < 0) {
         cleanup();
         return EXIT_FAILURE;
     }
@@ -169,9 +596,26 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        if (engine == ENGINE_POOL) {
+            // Blocks while the queue is full, leaving new clients in the listen backlog
+            if (pool_submit(client_fd) < 0) {
+                close(client_fd);
+                continue;
+            }
+            log_event(LOG_INFO, "Accepted connection from port %d", PORT);
+            continue;
+        }
+
+        reap_clients(false);
+
         struct client* new_client = calloc(1, sizeof(struct client));
+        if (!new_client) {
+            syslog(LOG_ERR, "Client allocation failed");
+            close(client_fd);
+            continue;
+        }
         new_client->client_fd = client_fd;
-        new_client->complete = false;
+        atomic_init(&new_client->complete, false);
         SLIST_INSERT_HEAD(&client_head, new_client, entries);
 
         if (pthread_create(&new_client->thread, NULL, client_handler, new_client) != 0) {
@@ -182,16 +626,13 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
-        syslog(LOG_INFO, "Accepted connection from port %d", PORT);
+        log_event(LOG_INFO, "Accepted connection from port %d", PORT);
     }
 
     // Join and free all threads
-    struct client *cp;
-    SLIST_FOREACH(cp, &client_head, entries) {
-        pthread_join(cp->thread, NULL);
-        SLIST_REMOVE(&client_head, cp, client, entries);
-        free(cp);
-    }
+    if (engine == ENGINE_POOL) pool_stop();
+    close_clients();
+    reap_clients(true);
 
     cleanup();
     return EXIT_SUCCESS;
@@ -0,0 +1,116 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "framer.h"
+
+#define PORT 9000
+#define BACKLOG 10
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+// Where each packet of DATA_FILE ends, for seeks and fast restarts
+#define INDEX_FILE "/var/tmp/aesdsocketdata.idx"
+// Segments of the durable wal store, kept across restarts
+#define WAL_DIR "/var/tmp/aesdsocket-wal"
+
+// State shared between the accept loop and the connection engines
+extern int server_fd;
+extern int data_fd;
+extern int wake_fd;
+extern volatile sig_atomic_t running;
+
+// Create a listening socket on PORT, optionally with SO_REUSEPORT set
+int open_listener(bool reuseport);
+
+// Serve one blocking client connection until it closes; the caller closes client_fd
+void serve_client(int client_fd);
+
+// Log a failed reply send; a client that went away is not an error
+void log_send_failure(int err);
+
+// Control packets, answered from the history without being stored
+#define SEEK_CMD "AESDCHAR_IOCSEEKTO:"
+#define READFROM_CMD "AESDCHAR_READFROM:"
+#define COMPRESS_CMD "AESDCHAR_COMPRESS:"
+
+/**
+ * Append a packet, or run a control packet: SEEK_CMD "X,Y" replies from
+ * byte Y of packet X, counted from the oldest packet held,
+ * READFROM_CMD "N" replies from history position N, and COMPRESS_CMD "1"
+ * or "0" sets *compress, which selects compressed replies on this
+ * connection. The reply to send is [*start, *end); it is empty after a
+ * malformed or failed command, including SEEK_CMD against a store without
+ * seek(), and after COMPRESS_CMD.
+ * With nonblock set, a store with append_async() only queues the packet:
+ * 1 is returned, and the reply may go out once durable(*end) is 1.
+ */
+int commit_packet(const char *pkt, size_t len, size_t *start, size_t *end, bool *compress, bool nonblock);
+
+// A compressed reply frame starts with its raw length and its stored length, little endian
+#define ZFRAME_HEADER 8
+// Set in the raw length of the last frame of a reply
+#define ZFRAME_LAST 0x80000000u
+
+/**
+ * A compressed reply: frames of at most LZ_BLOCK raw bytes, each stored
+ * as an LZ4 block, or raw when its stored length is 0. The frames expand
+ * to exactly the plain reply, and an empty reply is a single empty last
+ * frame, so a client always knows where a reply ends.
+ */
+struct zreply {
+    char *buf;
+    size_t len;
+    size_t cap;
+    /**
+     * Bytes of buf already sent
+     */
+    size_t sent;
+    /**
+     * One block of history being compressed
+     */
+    char *raw;
+};
+
+// Build the compressed form of the history range [off, end) in z
+int compress_reply(struct zreply *z, size_t off, size_t end);
+
+void zreply_release(struct zreply *z);
+
+/**
+ * A connection served with blocking replies: the thread engine runs one
+ * to completion, the pool engine serves it a turn at a time.
+ */
+struct session {
+    int fd;
+    struct framer in;
+    struct zreply z;
+    bool compress;
+};
+
+void session_open(struct session *s, int fd);
+
+// Commit and reply to every complete packet received so far; -1 once the connection must close
+int session_reply(struct session *s);
+
+// Receive into the session with recv() flags; returns as recv() does, 0 once the client closed
+ssize_t session_recv(struct session *s, int flags);
+
+// Free the session's buffers; its fd is left to the caller to close
+void session_release(struct session *s);
+
+// Worker pool fed by a bounded queue of accepted fds; idle connections wait in epoll, not in a worker
+int pool_start(int workers, int depth);
+int pool_submit(int client_fd);
+void pool_stop(void);
+
+// Run count edge-triggered epoll reactors until shutdown
+int run_reactors(int count);
+
+// Run the io_uring engine until shutdown; returns 1 if io_uring is unavailable
+int run_uring(void);
+
+#endif /* AESDSOCKET_H */
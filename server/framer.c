@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "framer.h"
+
+// Keep at least this much room for each recv()
+#define FRAMER_MIN_SPACE 1024
+// Upper bound on idle buffers kept around for new connections
+#define POOL_MAX 1024
+
+// Free buffers are chained through their first bytes
+struct pool_buf {
+    struct pool_buf *next;
+};
+
+static struct pool_buf *pool_head;
+static size_t pool_count;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *pool_get(void) {
+    struct pool_buf *b;
+
+    pthread_mutex_lock(&pool_lock);
+    b = pool_head;
+    if (b) {
+        pool_head = b->next;
+        pool_count--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return b ? (char*)b : malloc(FRAMER_BUF);
+}
+
+static void pool_put(char *buf) {
+    struct pool_buf *b = (struct pool_buf*)buf;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count < POOL_MAX) {
+        b->next = pool_head;
+        pool_head = b;
+        pool_count++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    free(b);
+}
+
+void framer_init(struct framer *f) {
+    memset(f, 0, sizeof(struct framer));
+}
+
+char *framer_space(struct framer *f, size_t *avail) {
+    // Drop a buffer grown for an earlier large packet once it has drained
+    if (f->buf && f->len == 0 && f->cap > FRAMER_BUF) {
+        free(f->buf);
+        f->buf = NULL;
+    }
+
+    if (!f->buf) {
+        f->buf = pool_get();
+        if (!f->buf) return NULL;
+        f->cap = FRAMER_BUF;
+        f->start = f->len = f->scanned = 0;
+    }
+
+    if (f->cap - f->start - f->len < FRAMER_MIN_SPACE && f->start > 0) {
+        memmove(f->buf, f->buf + f->start, f->len);
+        f->start = 0;
+    }
+
+    if (f->cap - f->len < FRAMER_MIN_SPACE) {
+        size_t cap = f->cap * 2;
+        char *buf;
+        if (f->cap == FRAMER_BUF) {
+            buf = malloc(cap);
+            if (buf) {
+                memcpy(buf, f->buf, f->len);
+                pool_put(f->buf);
+            }
+        } else {
+            buf = realloc(f->buf, cap);
+        }
+        if (!buf) return NULL;
+        f->buf = buf;
+        f->cap = cap;
+    }
+
+    *avail = f->cap - f->start - f->len;
+    return f->buf + f->start + f->len;
+}
+
+void framer_fill(struct framer *f, size_t n) {
+    f->len += n;
+}
+
+bool framer_next(struct framer *f, const char **pkt, size_t *len) {
+    if (f->scanned == f->len) return false;
+
+    char *base = f->buf + f->start;
+    // glibc memchr is vectorized, so this scans 16-32 bytes per step
+    char *nl = memchr(base + f->scanned, '\n', f->len - f->scanned);
+
+    if (!nl) {
+        f->scanned = f->len;
+        return false;
+    }
+
+    *pkt = base;
+    *len = nl - base + 1;
+    f->start += *len;
+    f->len -= *len;
+    f->scanned = 0;
+    if (f->len == 0) f->start = 0;
+    return true;
+}
+
+void framer_release(struct framer *f) {
+    if (f->buf) {
+        if (f->cap == FRAMER_BUF) pool_put(f->buf);
+        else free(f->buf);
+    }
+    framer_init(f);
+}
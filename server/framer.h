@@ -0,0 +1,45 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of the pooled receive buffers every connection starts with
+#define FRAMER_BUF 4096
+
+/**
+ * Per-connection receive buffer that splits the byte stream into newline
+ * terminated packets. Bytes of an unfinished packet stay buffered across
+ * recv() calls and are only scanned once, so large packets cost O(n).
+ */
+struct framer {
+    char *buf;
+    size_t cap;
+    /**
+     * Offset of the first byte of the pending packet in buf
+     */
+    size_t start;
+    /**
+     * Number of buffered bytes from start
+     */
+    size_t len;
+    /**
+     * Number of bytes from start already known to hold no newline
+     */
+    size_t scanned;
+};
+
+void framer_init(struct framer *f);
+
+// Free space to recv() into, or NULL when no memory is available
+char *framer_space(struct framer *f, size_t *avail);
+
+// Account for n bytes received into the space returned by framer_space()
+void framer_fill(struct framer *f, size_t n);
+
+// Pop the next complete packet including its newline; valid until the next framer call
+bool framer_next(struct framer *f, const char **pkt, size_t *len);
+
+void framer_release(struct framer *f);
+
+#endif /* FRAMER_H */
@@ -0,0 +1,490 @@
+/*
+ * loadgen.c
+ *
+ * Load generator for aesdsocket. Opens many concurrent connections, sends
+ * newline terminated packets at a fixed rate or as fast as replies come
+ * back, checks every reply against the history this connection has seen and
+ * reports throughput and latency percentiles.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#define MAX_EVENTS 256
+#define RECV_BUF (256 * 1024)
+
+// Log-linear histogram: 2^SUB_BITS linear buckets per power of two, ~1% precision
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+enum lstate {
+    LC_CONNECTING,
+    LC_SENDING,
+    LC_RECEIVING,
+    LC_WAITING,
+    LC_DONE,
+};
+
+struct lconn {
+    int fd;
+    int id;
+    enum lstate state;
+    uint64_t seq;
+    char *pkt;
+    size_t pkt_len;
+    size_t sent;
+    /**
+     * Previous packet of this connection and the history offset it ended at
+     */
+    char *prev;
+    size_t prev_len;
+    size_t prev_end;
+    /**
+     * Reply bytes received so far and the last pkt_len of them
+     */
+    size_t got;
+    char *tail;
+    size_t tail_len;
+    uint64_t t_start;
+    uint64_t next_due;
+    uint64_t packets;
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    struct lconn *conns;
+    int nconns;
+    struct hist hist;
+    uint64_t packets;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t connects;
+    uint64_t errors;
+};
+
+static struct {
+    struct sockaddr_in addr;
+    int conns;
+    int threads;
+    size_t size;
+    double rate;
+    double duration;
+    uint64_t count;
+    bool reconnect;
+    bool json;
+    bool bounded;
+} cfg = {
+    .conns = 16,
+    .threads = 1,
+    .size = 64,
+    .duration = 10,
+};
+
+static uint64_t deadline;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < SUB_COUNT) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SUB_BITS + 1;
+    return (shift + 1) * SUB_COUNT + (int)((v >> shift) - SUB_COUNT);
+}
+
+// Upper bound of the values counted in bucket idx
+static uint64_t hist_value(int idx) {
+    if (idx < SUB_COUNT) return idx;
+    int shift = idx / SUB_COUNT - 1;
+    uint64_t sub = idx % SUB_COUNT + SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct hist *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct) {
+    uint64_t want = (uint64_t)(h->total * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// Packets carry the connection id and sequence, so each one is unique in the history
+static void lconn_make_packet(struct lconn *c) {
+    int n = snprintf(c->pkt, cfg.size, "c%d s%llu ", c->id, (unsigned long long)c->seq++);
+    if ((size_t)n >= cfg.size) n = cfg.size - 1;
+    memset(c->pkt + n, 'x', cfg.size - 1 - n);
+    c->pkt[cfg.size - 1] = '\n';
+    c->pkt_len = cfg.size;
+    c->sent = 0;
+    c->got = 0;
+    c->tail_len = 0;
+}
+
+static int lconn_open(struct worker *w, struct lconn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = LC_CONNECTING;
+    w->connects++;
+    return 0;
+}
+
+static void lconn_close(struct worker *w, struct lconn *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+}
+
+// Feed reply bytes at history offset c->got; returns true once the reply is complete
+static bool lconn_consume(struct worker *w, struct lconn *c, const char *data, size_t n) {
+    size_t pos = c->got;
+
+    // The previous packet must still sit where the last reply ended, unless the server drops old history
+    if (!cfg.bounded && c->prev_len && pos < c->prev_end && pos + n > c->prev_end - c->prev_len) {
+        size_t lo = pos > c->prev_end - c->prev_len ? pos : c->prev_end - c->prev_len;
+        size_t hi = pos + n < c->prev_end ? pos + n : c->prev_end;
+        if (memcmp(data + (lo - pos), c->prev + (lo - (c->prev_end - c->prev_len)), hi - lo) != 0) {
+            w->errors++;
+        }
+    }
+
+    if (n >= c->pkt_len) {
+        memcpy(c->tail, data + n - c->pkt_len, c->pkt_len);
+        c->tail_len = c->pkt_len;
+    } else {
+        size_t keep = c->tail_len + n > c->pkt_len ? c->pkt_len - n : c->tail_len;
+        memmove(c->tail, c->tail + c->tail_len - keep, keep);
+        memcpy(c->tail + keep, data, n);
+        c->tail_len = keep + n;
+    }
+    c->got += n;
+
+    return c->tail_len == c->pkt_len && memcmp(c->tail, c->pkt, c->pkt_len) == 0;
+}
+
+static void lconn_finish_packet(struct worker *w, struct lconn *c, uint64_t now) {
+    if (!cfg.bounded && c->got <= c->prev_end) w->errors++;
+
+    hist_record(&w->hist, now - c->t_start);
+    w->packets++;
+    c->packets++;
+
+    memcpy(c->prev, c->pkt, c->pkt_len);
+    c->prev_len = c->pkt_len;
+    c->prev_end = c->got;
+
+    if (cfg.count && c->packets >= cfg.count) {
+        c->state = LC_DONE;
+        lconn_close(w, c);
+        return;
+    }
+
+    // With a fixed rate, latency is measured from when the packet was due
+    if (cfg.rate > 0) {
+        c->next_due += (uint64_t)(1e9 / cfg.rate);
+    } else {
+        c->next_due = now;
+    }
+    c->state = LC_WAITING;
+    if (cfg.reconnect) lconn_close(w, c);
+}
+
+// Push the connection forward until it would block
+static void lconn_drive(struct worker *w, struct lconn *c) {
+    static __thread char buf[RECV_BUF];
+
+    for (;;) {
+        uint64_t now = now_ns();
+
+        switch (c->state) {
+        case LC_CONNECTING: {
+            struct sockaddr_in peer;
+            socklen_t plen = sizeof(peer);
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getpeername(c->fd, (struct sockaddr*)&peer, &plen) == 0) {
+                c->state = LC_WAITING;
+                break;
+            }
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) return;
+            w->errors++;
+            lconn_close(w, c);
+            c->state = LC_WAITING;
+            return;
+        }
+        case LC_WAITING:
+            if (now < c->next_due || now >= deadline) return;
+            if (c->fd < 0) {
+                if (lconn_open(w, c) < 0) {
+                    w->errors++;
+                    return;
+                }
+                break;
+            }
+            lconn_make_packet(c);
+            c->t_start = cfg.rate > 0 ? c->next_due : now;
+            c->state = LC_SENDING;
+            break;
+        case LC_SENDING: {
+            ssize_t n = send(c->fd, c->pkt + c->sent, c->pkt_len - c->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                w->errors++;
+                lconn_close(w, c);
+                c->state = LC_WAITING;
+                return;
+            }
+            c->sent += n;
+            w->bytes_out += n;
+            if (c->sent == c->pkt_len) c->state = LC_RECEIVING;
+            break;
+        }
+        case LC_RECEIVING: {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n <= 0) {
+                w->errors++;
+                lconn_close(w, c);
+                c->state = LC_WAITING;
+                return;
+            }
+            w->bytes_in += n;
+            if (lconn_consume(w, c, buf, n)) lconn_finish_packet(w, c, now_ns());
+            break;
+        }
+        case LC_DONE:
+            return;
+        }
+    }
+}
+
+static void* worker_loop(void* arg) {
+    struct worker *w = (struct worker*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < w->nconns; i++) {
+        w->conns[i].next_due = now_ns();
+        if (lconn_open(w, &w->conns[i]) < 0) w->errors++;
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= deadline) break;
+
+        bool active = false;
+        for (int i = 0; i < w->nconns; i++) {
+            if (w->conns[i].state != LC_DONE) active = true;
+        }
+        if (!active) break;
+
+        // Rate-limited and reconnecting clients wake up on a 1 ms tick
+        int timeout = (cfg.rate > 0 || cfg.reconnect) ? 1 : 100;
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            lconn_drive(w, (struct lconn*)events[i].data.ptr);
+        }
+        if (cfg.rate > 0 || cfg.reconnect) {
+            for (int i = 0; i < w->nconns; i++) {
+                if (w->conns[i].state == LC_WAITING) lconn_drive(w, &w->conns[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) lconn_close(w, &w->conns[i]);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-P port] [-c conns] [-t threads] [-s size] [-r rate]\n"
+            "          [-d seconds] [-n packets] [-k] [-j] [-b]\n"
+            "  -c  concurrent connections (16)\n"
+            "  -t  client threads (1)\n"
+            "  -s  packet size in bytes including the newline, at least 24 (64)\n"
+            "  -r  packets per second per connection, 0 waits for each reply (0)\n"
+            "  -d  run time in seconds (10)\n"
+            "  -n  stop each connection after this many packets (unlimited)\n"
+            "  -k  reconnect for every packet\n"
+            "  -j  print the summary as JSON\n"
+            "  -b  the server keeps bounded history (-s ring), only check that replies end with the packet\n",
+            prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 9000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:P:c:t:s:r:d:n:kjb")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'P': port = atoi(optarg); break;
+            case 'c': cfg.conns = atoi(optarg); break;
+            case 't': cfg.threads = atoi(optarg); break;
+            case 's': cfg.size = strtoul(optarg, NULL, 0); break;
+            case 'r': cfg.rate = atof(optarg); break;
+            case 'd': cfg.duration = atof(optarg); break;
+            case 'n': cfg.count = strtoull(optarg, NULL, 0); break;
+            case 'k': cfg.reconnect = true; break;
+            case 'j': cfg.json = true; break;
+            case 'b': cfg.bounded = true; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    // Packets must hold their "c<id> s<seq> " header to stay unique in the history
+    if (cfg.conns < 1 || cfg.threads < 1 || cfg.size < 24) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (cfg.threads > cfg.conns) cfg.threads = cfg.conns;
+
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &cfg.addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address '%s'\n", host);
+        return EXIT_FAILURE;
+    }
+
+    struct lconn *conns = calloc(cfg.conns, sizeof(struct lconn));
+    struct worker *workers = calloc(cfg.threads, sizeof(struct worker));
+    if (!conns || !workers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < cfg.conns; i++) {
+        conns[i].id = i;
+        conns[i].fd = -1;
+        conns[i].pkt = malloc(cfg.size);
+        conns[i].prev = malloc(cfg.size);
+        conns[i].tail = malloc(cfg.size);
+        if (!conns[i].pkt || !conns[i].prev || !conns[i].tail) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t start = now_ns();
+    deadline = start + (uint64_t)(cfg.duration * 1e9);
+
+    int per = cfg.conns / cfg.threads;
+    int extra = cfg.conns % cfg.threads;
+    struct lconn *next = conns;
+    for (int i = 0; i < cfg.threads; i++) {
+        struct worker *w = &workers[i];
+        w->conns = next;
+        w->nconns = per + (i < extra);
+        next += w->nconns;
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0 || pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            perror("worker start");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct hist *all = calloc(1, sizeof(struct hist));
+    uint64_t packets = 0, bytes_out = 0, bytes_in = 0, connects = 0, errors = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].epoll_fd);
+        hist_merge(all, &workers[i].hist);
+        packets += workers[i].packets;
+        bytes_out += workers[i].bytes_out;
+        bytes_in += workers[i].bytes_in;
+        connects += workers[i].connects;
+        errors += workers[i].errors;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    double us[5] = {
+        hist_percentile(all, 50) / 1e3,
+        hist_percentile(all, 90) / 1e3,
+        hist_percentile(all, 99) / 1e3,
+        hist_percentile(all, 99.9) / 1e3,
+        all->max / 1e3,
+    };
+
+    if (cfg.json) {
+        printf("{\"connections\": %d, \"packet_size\": %zu, \"seconds\": %.3f, "
+               "\"packets\": %llu, \"packets_per_sec\": %.1f, \"connects_per_sec\": %.1f, "
+               "\"mb_out_per_sec\": %.3f, \"mb_in_per_sec\": %.3f, \"errors\": %llu, "
+               "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+               cfg.conns, cfg.size, secs, (unsigned long long)packets, packets / secs,
+               connects / secs, bytes_out / secs / 1e6, bytes_in / secs / 1e6,
+               (unsigned long long)errors, us[0], us[1], us[2], us[3], us[4]);
+    } else {
+        printf("connections:   %d x %zu byte packets over %.2f s\n", cfg.conns, cfg.size, secs);
+        printf("packets:       %llu (%.1f/s)\n", (unsigned long long)packets, packets / secs);
+        printf("connects:      %llu (%.1f/s)\n", (unsigned long long)connects, connects / secs);
+        printf("throughput:    %.3f MB/s out, %.3f MB/s in\n", bytes_out / secs / 1e6, bytes_in / secs / 1e6);
+        printf("latency (us):  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               us[0], us[1], us[2], us[3], us[4]);
+        printf("errors:        %llu\n", (unsigned long long)errors);
+    }
+
+    for (int i = 0; i < cfg.conns; i++) {
+        free(conns[i].pkt);
+        free(conns[i].prev);
+        free(conns[i].tail);
+    }
+    free(conns);
+    free(workers);
+    free(all);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "stats.h"
+
+// Bounded ring of formatted messages; when the logger falls behind, new
+// messages are dropped and counted rather than stalling the caller
+#define LOG_RING 1024
+#define LOG_LINE 128
+
+struct log_entry {
+    int prio;
+    char text[LOG_LINE];
+};
+
+static enum log_mode mode = LOG_MODE_SYNC;
+static struct log_entry ring[LOG_RING];
+static size_t head;
+static size_t tail;
+static bool stopping;
+static bool started;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+static void* log_loop(void* arg) {
+    struct log_entry batch[64];
+
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        while (!stopping && head == tail) {
+            pthread_cond_wait(&log_cond, &log_lock);
+        }
+        if (head == tail) break;
+
+        size_t n = 0;
+        while (tail != head && n < sizeof(batch) / sizeof(batch[0])) {
+            batch[n++] = ring[tail % LOG_RING];
+            tail++;
+        }
+        pthread_mutex_unlock(&log_lock);
+
+        for (size_t i = 0; i < n; i++) {
+            syslog(batch[i].prio, "%s", batch[i].text);
+        }
+
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+int log_start(enum log_mode m) {
+    mode = m;
+    if (mode != LOG_MODE_ASYNC) return 0;
+
+    if (pthread_create(&log_thread, NULL, log_loop, NULL) != 0) {
+        syslog(LOG_ERR, "Logger thread creation failed, logging synchronously");
+        mode = LOG_MODE_SYNC;
+        return -1;
+    }
+    started = true;
+    return 0;
+}
+
+// Flush whatever is queued and return to synchronous logging
+void log_stop(void) {
+    if (!started) return;
+
+    pthread_mutex_lock(&log_lock);
+    stopping = true;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_thread, NULL);
+    started = false;
+    mode = LOG_MODE_SYNC;
+}
+
+void log_event(int prio, const char *fmt, ...) {
+    va_list ap;
+
+    // Errors are always reported, only routine messages are silenced
+    if (mode == LOG_MODE_QUIET && prio > LOG_WARNING) return;
+
+    va_start(ap, fmt);
+    if (mode != LOG_MODE_ASYNC) {
+        vsyslog(prio, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    if (head - tail == LOG_RING) {
+        pthread_mutex_unlock(&log_lock);
+        va_end(ap);
+        stats_add(STAT_LOG_DROPPED, 1);
+        return;
+    }
+    struct log_entry *e = &ring[head % LOG_RING];
+    e->prio = prio;
+    vsnprintf(e->text, sizeof(e->text), fmt, ap);
+    va_end(ap);
+    if (head++ == tail) pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,16 @@
+#ifndef LOG_H
+#define LOG_H
+
+enum log_mode {
+    LOG_MODE_SYNC,
+    LOG_MODE_ASYNC,
+    LOG_MODE_QUIET,
+};
+
+// Per-connection messages go through log_event so syslog stays off the hot path
+int log_start(enum log_mode mode);
+void log_stop(void);
+
+void log_event(int prio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LOG_H */
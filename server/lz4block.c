@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4block.h"
+
+#define MINMATCH 4
+// The format requires the last 5 bytes to be literals and no match to start in the last 12
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define MAX_DISTANCE 65535
+#define HASH_LOG 12
+// After 2^SKIP_TRIGGER misses in a row, step further ahead each time through incompressible input
+#define SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned hash4(const uint8_t *p) {
+    return (read32(p) * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Bytes that continue a length field whose 4 token bits are all set
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    unsigned b;
+
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Greedy single-pass compressor: a hash table of recent positions keyed
+ * on the next 4 bytes proposes one candidate per position, which is
+ * extended both ways when its bytes match.
+ */
+size_t lz4_compress_block(const char *src, size_t len, char *dst, size_t cap) {
+    const uint8_t *base = (const uint8_t*)src, *ip = base, *anchor = base;
+    const uint8_t *end = base + len;
+    uint8_t *op = (uint8_t*)dst, *oend = op + cap;
+    uint32_t table[1 << HASH_LOG];
+
+    if (len > MFLIMIT) {
+        const uint8_t *mflimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+        unsigned attempts = 1 << SKIP_TRIGGER;
+
+        // Empty slots point at the first byte; every candidate is checked anyway
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mflimit) {
+            unsigned h = hash4(ip);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+                ip += attempts++ >> SKIP_TRIGGER;
+                continue;
+            }
+            attempts = 1 << SKIP_TRIGGER;
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + MINMATCH, *rp = ref + MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor, mlen = mp - ip - MINMATCH, dist = ip - ref;
+            if ((size_t)(oend - op) < lit + lit / 255 + mlen / 255 + 5) return 0;
+            *op++ = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = dist & 0xff;
+            *op++ = dist >> 8;
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+
+            ip = anchor = mp;
+            // Index a position inside the match so a repeat of it is found at once
+            if (ip < mflimit) table[hash4(ip - 2)] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    // The last sequence is literals only
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < lit + lit / 255 + 2) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (uint8_t*)dst;
+}
+
+ssize_t lz4_decompress_block(const char *src, size_t len, char *dst, size_t cap) {
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + len;
+    uint8_t *op = (uint8_t*)dst, *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15, dist;
+
+        // Short runs are copied with one fixed 16 byte move while both buffers have room for it
+        if (lit < 15 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            if (lit == 15 && get_length(&ip, iend, &lit) < 0) return -1;
+            if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+            memcpy(op, ip, lit);
+        }
+        ip += lit;
+        op += lit;
+        if (ip == iend) return op - (uint8_t*)dst;
+
+        if (iend - ip < 2) return -1;
+        dist = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (dist == 0 || dist > (size_t)(op - (uint8_t*)dst)) return -1;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) < 0) return -1;
+        mlen += MINMATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // A match may overlap its own output; each copy doubles the distance it can cover
+        const uint8_t *ref = op - dist;
+        if (mlen <= 16 && dist >= 16 && oend - op >= 16) {
+            memcpy(op, ref, 16);
+            op += mlen;
+            continue;
+        }
+        while (mlen > 0) {
+            size_t n = op - ref < (ptrdiff_t)mlen ? (size_t)(op - ref) : mlen;
+            memcpy(op, ref, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+    // Empty input, or a block that ends in a match
+    return -1;
+}
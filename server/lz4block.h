@@ -0,0 +1,24 @@
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * LZ4 block format codec: a block holds sequences of literals and 4+ byte
+ * matches up to 64 KiB back, with no header or checksum. Blocks written
+ * here decode with LZ4_decompress_safe() and the other way round, so
+ * clients of compressed replies can use any LZ4 library.
+ */
+
+// Largest compressed size of n input bytes
+#define LZ4_BLOCK_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress len bytes into dst; 0 when they do not fit in cap bytes
+size_t lz4_compress_block(const char *src, size_t len, char *dst, size_t cap);
+
+// Decompress a whole block into dst; -1 when it is malformed or needs more than cap bytes.
+// Bytes of dst past the decompressed length may be overwritten, never past cap
+ssize_t lz4_decompress_block(const char *src, size_t len, char *dst, size_t cap);
+
+#endif /* LZ4BLOCK_H */
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "aesdsocket.h"
+#include "log.h"
+
+#define MAX_EVENTS 64
+// Receives a connection gets per turn before it goes to the back of the queue
+#define TURN_RECVS 16
+
+/**
+ * A pool connection is always in exactly one place: the ready queue, a
+ * worker, or parked in the epoll set waiting for its next packet.
+ */
+struct pool_conn {
+    struct session s;
+    // Accepted but not yet served, counted against the queue depth
+    bool fresh;
+    // Being served by a worker
+    bool active;
+    TAILQ_ENTRY(pool_conn) ready;
+    LIST_ENTRY(pool_conn) all;
+};
+
+// Ready connections, fed by the accept loop and the poller and drained by all workers
+struct conn_queue {
+    TAILQ_HEAD(, pool_conn) ready;
+    LIST_HEAD(, pool_conn) all;
+    int depth;
+    int fresh;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static struct conn_queue queue = {
+    .ready = TAILQ_HEAD_INITIALIZER(queue.ready),
+    .all = LIST_HEAD_INITIALIZER(queue.all),
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+static pthread_t *workers;
+static int nworkers;
+static pthread_t poller;
+static bool poller_started;
+static int epoll_fd = -1;
+// Sentinel stored in epoll_event.data.ptr for wake_fd
+static char wake_tag;
+
+// Caller holds queue.lock
+static void conn_ready(struct pool_conn *pc) {
+    TAILQ_INSERT_TAIL(&queue.ready, pc, ready);
+    pthread_cond_signal(&queue.not_empty);
+}
+
+// Caller holds queue.lock; closing under it keeps pool_stop() from shutting down a reused fd
+static void conn_free(struct pool_conn *pc) {
+    LIST_REMOVE(pc, all);
+    session_release(&pc->s);
+    close(pc->s.fd);
+    free(pc);
+}
+
+// Wait in epoll for the next packet; the connection is not touched again until it is ready
+static bool conn_park(struct pool_conn *pc) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = pc };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pc->s.fd, &ev) == 0) return true;
+    if (errno == ENOENT && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pc->s.fd, &ev) == 0) return true;
+    log_event(LOG_ERR, "epoll_ctl failed");
+    return false;
+}
+
+/**
+ * Serve one turn of a connection: reply to what it sent, then read on
+ * without blocking. Returns -1 once it must close, 0 when it is idle and
+ * 1 when it still has input after its turn.
+ */
+static int conn_turn(struct pool_conn *pc) {
+    for (int i = 0; i < TURN_RECVS; i++) {
+        if (session_reply(&pc->s) < 0) return -1;
+        ssize_t rcv_len = session_recv(&pc->s, MSG_DONTWAIT);
+        if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (rcv_len <= 0) return -1;
+    }
+    return 1;
+}
+
+static void* worker_loop(void* arg) {
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (TAILQ_EMPTY(&queue.ready) && !queue.stopping) {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        }
+        if (queue.stopping) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        struct pool_conn *pc = TAILQ_FIRST(&queue.ready);
+        TAILQ_REMOVE(&queue.ready, pc, ready);
+        if (pc->fresh) {
+            pc->fresh = false;
+            queue.fresh--;
+            pthread_cond_signal(&queue.not_full);
+        }
+        pc->active = true;
+        pthread_mutex_unlock(&queue.lock);
+
+        int rc = conn_turn(pc);
+
+        pthread_mutex_lock(&queue.lock);
+        pc->active = false;
+        if (queue.stopping || rc < 0 || (rc == 0 && !conn_park(pc))) {
+            conn_free(pc);
+        } else if (rc > 0) {
+            conn_ready(pc);
+        }
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+// Move parked connections back to the ready queue as their next packets arrive
+static void* poller_loop(void* arg) {
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed");
+            break;
+        }
+
+        pthread_mutex_lock(&queue.lock);
+        bool stopping = queue.stopping;
+        for (int i = 0; i < n && !stopping; i++) {
+            if (events[i].data.ptr == &wake_tag) {
+                stopping = true;
+                break;
+            }
+            conn_ready(events[i].data.ptr);
+        }
+        pthread_mutex_unlock(&queue.lock);
+        if (stopping) break;
+    }
+    return NULL;
+}
+
+int pool_start(int count, int depth) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+
+    workers = calloc(count, sizeof(pthread_t));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!workers || epoll_fd < 0) {
+        syslog(LOG_ERR, "Pool allocation failed");
+        pool_stop();
+        return -1;
+    }
+    queue.depth = depth;
+
+    // wake_fd is never drained, so the poller sees it however late it looks
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0 ||
+        pthread_create(&poller, NULL, poller_loop, NULL) != 0) {
+        syslog(LOG_ERR, "Pool poller creation failed");
+        pool_stop();
+        return -1;
+    }
+    poller_started = true;
+
+    for (nworkers = 0; nworkers < count; nworkers++) {
+        if (pthread_create(&workers[nworkers], NULL, worker_loop, NULL) != 0) {
+            syslog(LOG_ERR, "Worker thread creation failed");
+            pool_stop();
+            return -1;
+        }
+    }
+    syslog(LOG_INFO, "Started %d workers with queue depth %d", count, depth);
+    return 0;
+}
+
+// Blocks while the queue is full; fails only once shutdown has begun
+int pool_submit(int client_fd) {
+    struct pool_conn *pc = calloc(1, sizeof(*pc));
+    if (!pc) {
+        syslog(LOG_ERR, "Client allocation failed");
+        return -1;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.fresh == queue.depth && running && !queue.stopping) {
+        // The signal handler cannot signal the condition, so poll running
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&queue.not_full, &queue.lock, &ts);
+    }
+    if (!running || queue.stopping) {
+        pthread_mutex_unlock(&queue.lock);
+        free(pc);
+        return -1;
+    }
+    session_open(&pc->s, client_fd);
+    pc->fresh = true;
+    queue.fresh++;
+    LIST_INSERT_HEAD(&queue.all, pc, all);
+    conn_ready(pc);
+    pthread_mutex_unlock(&queue.lock);
+    return 0;
+}
+
+void pool_stop(void) {
+    struct pool_conn *pc;
+
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = true;
+    // Unblock the connections in progress; the rest are closed once the workers are gone
+    LIST_FOREACH(pc, &queue.all, all) {
+        if (pc->active) shutdown(pc->s.fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_cond_broadcast(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+    if (wake_fd >= 0) eventfd_write(wake_fd, 1);
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (poller_started) pthread_join(poller, NULL);
+
+    while ((pc = LIST_FIRST(&queue.all))) {
+        conn_free(pc);
+    }
+    TAILQ_INIT(&queue.ready);
+    queue.fresh = 0;
+    if (epoll_fd >= 0) close(epoll_fd);
+    free(workers);
+    workers = NULL;
+    epoll_fd = -1;
+    nworkers = 0;
+    poller_started = false;
+}
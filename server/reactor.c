@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "framer.h"
+#include "log.h"
+#include "stats.h"
+
+#define MAX_EVENTS 64
+
+// Non-blocking connection owned by a single reactor
+struct conn {
+    int fd;
+    struct framer in;
+    size_t reply_off;
+    size_t reply_end;
+    uint64_t reply_start;
+    bool replying;
+    // The packet is queued with append_async() and its reply waits for durable()
+    bool waiting;
+    bool compress;
+    struct zreply z;
+    LIST_ENTRY(conn) entries;
+};
+
+LIST_HEAD(conn_list, conn);
+
+struct reactor {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    pthread_t thread;
+    struct conn_list conns;
+};
+
+// Sentinels stored in epoll_event.data.ptr for the non-connection fds
+static char listen_tag;
+static char wake_tag;
+static char commit_tag;
+
+static void conn_close(struct reactor *r, struct conn *c) {
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    log_event(LOG_INFO, "Close connection on fd %d", c->fd);
+    LIST_REMOVE(c, entries);
+    framer_release(&c->in);
+    zreply_release(&c->z);
+    free(c);
+}
+
+// Start replying with the range committed for the last packet
+static bool conn_reply(struct conn *c) {
+    if (c->compress && compress_reply(&c->z, c->reply_off, c->reply_end) < 0) {
+        log_event(LOG_ERR, "Compressing reply failed");
+        return false;
+    }
+    // A compressed reply always holds at least the last frame's header
+    c->replying = c->compress || c->reply_off < c->reply_end;
+    return true;
+}
+
+// Commit one complete packet and remember the range to reply with
+static bool conn_commit(struct conn *c, const char *pkt, size_t pkt_len) {
+    uint64_t started = stats_now();
+    int rc = commit_packet(pkt, pkt_len, &c->reply_off, &c->reply_end, &c->compress, true);
+
+    stats_add(STAT_PACKETS, 1);
+    c->reply_start = started;
+    c->waiting = rc == 1;
+    return rc == 1 || (rc == 0 && conn_reply(c));
+}
+
+// Send as much of the pending reply as the socket accepts
+static int conn_send(struct conn *c) {
+    while (c->compress && c->z.sent < c->z.len) {
+        ssize_t sent = send(c->fd, c->z.buf + c->z.sent, c->z.len - c->z.sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_send_failure(errno);
+            return -1;
+        }
+        c->z.sent += sent;
+        stats_add(STAT_BYTES_OUT, sent);
+    }
+    while (!c->compress && c->reply_off < c->reply_end) {
+        ssize_t sent = store->send(c->fd, c->reply_off, c->reply_end);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            log_send_failure(errno);
+            return -1;
+        }
+        c->reply_off += sent;
+        stats_add(STAT_BYTES_OUT, sent);
+    }
+
+    c->replying = false;
+    stats_reply_done(c->reply_start);
+    return 1;
+}
+
+// Drive a connection until it would block; returns false once it is closed
+static bool conn_process(struct reactor *r, struct conn *c) {
+    for (;;) {
+        // Replies go out in packet order, so nothing more is read until this one can
+        if (c->waiting) return true;
+        if (c->replying) {
+            int rc = conn_send(c);
+            if (rc < 0) break;
+            if (rc == 0) return true;
+        }
+
+        const char *pkt;
+        size_t pkt_len;
+        if (framer_next(&c->in, &pkt, &pkt_len)) {
+            if (!conn_commit(c, pkt, pkt_len)) break;
+            continue;
+        }
+
+        size_t avail;
+        char *space = framer_space(&c->in, &avail);
+        if (!space) {
+            log_event(LOG_ERR, "Receive buffer allocation failed");
+            break;
+        }
+
+        ssize_t rcv_len = recv(c->fd, space, avail, 0);
+        if (rcv_len > 0) {
+            stats_add(STAT_BYTES_IN, rcv_len);
+            framer_fill(&c->in, rcv_len);
+            continue;
+        }
+        if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (rcv_len < 0) log_event(LOG_ERR, "Receive failed");
+        break;
+    }
+
+    conn_close(r, c);
+    return false;
+}
+
+static void reactor_accept(struct reactor *r) {
+    for (;;) {
+        int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && running) {
+                syslog(LOG_ERR, "Accept failed");
+            }
+            return;
+        }
+
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if (!c) {
+            syslog(LOG_ERR, "Connection allocation failed");
+            close(client_fd);
+            continue;
+        }
+        c->fd = client_fd;
+        framer_init(&c->in);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl failed for fd %d", client_fd);
+            close(client_fd);
+            free(c);
+            continue;
+        }
+        if (store->attach) store->attach(client_fd);
+        LIST_INSERT_HEAD(&r->conns, c, entries);
+        stats_add(STAT_CONNECTIONS, 1);
+        log_event(LOG_INFO, "Accepted connection from port %d on reactor %d", PORT, r->id);
+    }
+}
+
+// Resume the connections whose queued packets a store commit made durable
+static void reactor_committed(struct reactor *r) {
+    struct conn *c = LIST_FIRST(&r->conns);
+
+    while (c) {
+        struct conn *next = LIST_NEXT(c, entries);
+        int rc = c->waiting ? store->durable(c->reply_end) : 0;
+        if (rc != 0) {
+            c->waiting = false;
+            if (rc < 0 || !conn_reply(c)) {
+                conn_close(r, c);
+            } else {
+                conn_process(r, c);
+            }
+        }
+        c = next;
+    }
+}
+
+static void* reactor_loop(void* arg) {
+    struct reactor *r = (struct reactor*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed");
+            break;
+        }
+
+        bool committed = false;
+        for (int i = 0; i < n && running; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wake_tag) continue;
+            // Handled after the batch, since it may close connections later events point at
+            if (ptr == &commit_tag) {
+                committed = true;
+                continue;
+            }
+            if (ptr == &listen_tag) {
+                reactor_accept(r);
+                continue;
+            }
+            conn_process(r, (struct conn*)ptr);
+        }
+        if (committed && running) reactor_committed(r);
+    }
+
+    struct conn *c;
+    while ((c = LIST_FIRST(&r->conns)) != NULL) {
+        conn_close(r, c);
+    }
+    return NULL;
+}
+
+static int reactor_init(struct reactor *r, int id) {
+    struct epoll_event ev;
+
+    r->id = id;
+    LIST_INIT(&r->conns);
+    r->listen_fd = server_fd;
+
+    // Reactor 0 owns the listener bound by main, the rest share the port with SO_REUSEPORT
+    if (id > 0) {
+        r->listen_fd = open_listener(true);
+        if (r->listen_fd < 0 || listen(r->listen_fd, BACKLOG) < 0) {
+            syslog(LOG_ERR, "Listener setup failed for reactor %d", id);
+            return -1;
+        }
+    }
+    fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL) | O_NONBLOCK);
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd < 0) {
+        syslog(LOG_ERR, "epoll_create1 failed");
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for listener");
+        return -1;
+    }
+
+    // Level-triggered and never drained, so every reactor wakes on shutdown
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for wake fd");
+        return -1;
+    }
+
+    // Edge-triggered and never drained either: every write is an edge for every reactor
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &commit_tag;
+    if (store->commit_fd && epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, store->commit_fd(), &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for commit fd");
+        return -1;
+    }
+    return 0;
+}
+
+int run_reactors(int count) {
+    struct reactor *reactors = calloc(count, sizeof(struct reactor));
+    int started = 0;
+    int rc = 0;
+
+    if (!reactors) {
+        syslog(LOG_ERR, "Reactor allocation failed");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        reactors[i].epoll_fd = -1;
+        reactors[i].listen_fd = -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reactor_init(&reactors[i], i) < 0 ||
+            pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]) != 0) {
+            syslog(LOG_ERR, "Failed to start reactor %d", i);
+            running = 0;
+            if (wake_fd >= 0) eventfd_write(wake_fd, 1);
+            rc = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reactors[i].epoll_fd >= 0) close(reactors[i].epoll_fd);
+        if (i > 0 && reactors[i].listen_fd >= 0) close(reactors[i].listen_fd);
+    }
+    free(reactors);
+    return rc;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+# Startup time of aesdsocket -k with a large kept history.
+# Writes SIZE_MB of 64 byte packets straight to the data file, then times
+# from launching the server to its first reply, once rebuilding the packet
+# index from the data and once more with the index left by the first run.
+#
+# Usage: ./restart-bench.sh [SIZE_MB] [RUNS]
+
+set -e
+set -u
+
+SIZE_MB=${1:-1024}
+RUNS=${2:-5}
+DATA_FILE=/var/tmp/aesdsocketdata
+INDEX_FILE=/var/tmp/aesdsocketdata.idx
+PACKETS=$((SIZE_MB * 1024 * 1024 / 64))
+SIZE=$((PACKETS * 64))
+SERVER="$(dirname "$0")/aesdsocket"
+
+if (exec 3<>/dev/tcp/127.0.0.1/9000) 2> /dev/null; then
+    echo "Error: port 9000 is already in use"
+    exit 1
+fi
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Launch the server and wait until it answers with the last byte of the history;
+# the listener comes up before the history is opened, so connecting is not enough
+start_server() {
+    local start=$(now_ms)
+    "$SERVER" -k -l quiet > /dev/null 2>&1 &
+    SERVER_PID=$!
+    until exec 3<>/dev/tcp/127.0.0.1/9000; do
+        sleep 0.001
+    done 2> /dev/null
+    printf 'AESDCHAR_READFROM:%d\n' $((SIZE - 1)) >&3
+    IFS= read -r -t 60 reply <&3
+    exec 3<&-
+    ELAPSED=$(( $(now_ms) - start ))
+}
+
+stop_server() {
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" || true
+}
+
+echo "Writing ${PACKETS} packets, ${SIZE_MB} MB of history to ${DATA_FILE}"
+rm -f "$DATA_FILE" "$INDEX_FILE"
+yes "$(printf 'packet %056d' 0)" | head -n "$PACKETS" > "$DATA_FILE"
+
+for i in $(seq "$RUNS"); do
+    rm -f "$INDEX_FILE"
+    start_server
+    echo "rebuilding index: ${ELAPSED} ms"
+    stop_server
+done
+for i in $(seq "$RUNS"); do
+    start_server
+    echo "with index:       ${ELAPSED} ms"
+    stop_server
+done
+
+rm -f "$DATA_FILE" "$INDEX_FILE"
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "stats.h"
+
+static const char *counter_names[STAT_COUNT] = {
+    [STAT_CONNECTIONS] = "connections",
+    [STAT_BYTES_IN] = "bytes_in",
+    [STAT_BYTES_OUT] = "bytes_out",
+    [STAT_PACKETS] = "packets",
+    [STAT_REPLIES] = "replies",
+    [STAT_LOCK_WAITS] = "lock_waits",
+    [STAT_LOCK_WAIT_NS] = "lock_wait_ns",
+    [STAT_LOG_DROPPED] = "log_dropped",
+    [STAT_WAL_COMMITS] = "wal_commits",
+    [STAT_LZ_RAW_BYTES] = "lz_raw_bytes",
+    [STAT_LZ_STORED_BYTES] = "lz_stored_bytes",
+};
+
+// Registry of blocks, only ever pushed to; blocks of exited threads are reused
+static _Atomic(struct stats_block*) blocks;
+static __thread struct stats_block *mine;
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+
+static int dump_fd = -1;
+static int listen_fd = -1;
+static pthread_t stats_thread;
+static bool stats_running;
+
+static void block_release(void *arg) {
+    struct stats_block *b = arg;
+    atomic_store_explicit(&b->in_use, false, memory_order_release);
+}
+
+static void block_key_init(void) {
+    pthread_key_create(&block_key, block_release);
+}
+
+struct stats_block *stats_block_get(void) {
+    if (mine) return mine;
+
+    pthread_once(&block_once, block_key_init);
+
+    for (struct stats_block *b = atomic_load(&blocks); b; b = b->next) {
+        bool idle = false;
+        if (atomic_compare_exchange_strong(&b->in_use, &idle, true)) {
+            mine = b;
+            break;
+        }
+    }
+
+    if (!mine) {
+        static struct stats_block fallback;
+        struct stats_block *b = calloc(1, sizeof(struct stats_block));
+        // Without memory, share one block; counts may then race but never crash
+        if (!b) return &fallback;
+        atomic_init(&b->in_use, true);
+        b->next = atomic_load(&blocks);
+        while (!atomic_compare_exchange_weak(&blocks, &b->next, b)) {
+        }
+        mine = b;
+    }
+    pthread_setspecific(block_key, mine);
+    return mine;
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_reply_done(uint64_t started_ns) {
+    uint64_t us = (stats_now() - started_ns) / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_HIST_BUCKETS) bucket = STATS_HIST_BUCKETS - 1;
+
+    _Atomic uint64_t *h = &stats_block_get()->reply_hist[bucket];
+    atomic_store_explicit(h, atomic_load_explicit(h, memory_order_relaxed) + 1, memory_order_relaxed);
+    stats_add(STAT_REPLIES, 1);
+}
+
+void stats_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_trylock(lock) == 0) return;
+
+    uint64_t start = stats_now();
+    pthread_mutex_lock(lock);
+    stats_add(STAT_LOCK_WAITS, 1);
+    stats_add(STAT_LOCK_WAIT_NS, stats_now() - start);
+}
+
+size_t stats_format(char *buf, size_t len) {
+    uint64_t totals[STAT_COUNT] = {0};
+    uint64_t hist[STATS_HIST_BUCKETS] = {0};
+    uint64_t replies = 0;
+    size_t off = 0;
+
+    for (struct stats_block *b = atomic_load(&blocks); b; b = b->next) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            totals[i] += atomic_load_explicit(&b->counters[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+            hist[i] += atomic_load_explicit(&b->reply_hist[i], memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < STAT_COUNT && off < len; i++) {
+        off += snprintf(buf + off, len - off, "%s %llu\n", counter_names[i], (unsigned long long)totals[i]);
+    }
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) replies += hist[i];
+    const double pcts[] = { 50, 99, 99.9 };
+    const char *names[] = { "reply_p50_us", "reply_p99_us", "reply_p999_us" };
+    for (int p = 0; p < 3 && off < len; p++) {
+        uint64_t want = (uint64_t)(replies * pcts[p] / 100.0 + 0.5);
+        uint64_t seen = 0;
+        int i = 0;
+        for (; i < STATS_HIST_BUCKETS - 1; i++) {
+            seen += hist[i];
+            if (seen >= want && want > 0) break;
+        }
+        // Bucket i holds values below 2^i us; report that upper bound
+        off += snprintf(buf + off, len - off, "%s %llu\n", names[p],
+                        replies ? (unsigned long long)(1ULL << i) : 0ULL);
+    }
+    return off < len ? off : len;
+}
+
+static void stats_dump_syslog(void) {
+    char text[2048];
+    char *line = text;
+
+    stats_format(text, sizeof(text));
+    while (*line) {
+        char *nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        syslog(LOG_INFO, "stats: %s", line);
+        if (!nl) break;
+        line = nl + 1;
+    }
+}
+
+static void* stats_loop(void* arg) {
+    struct pollfd fds[3] = {
+        { .fd = dump_fd, .events = POLLIN },
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = listen_fd, .events = POLLIN },
+    };
+    char text[2048];
+
+    while (running) {
+        if (poll(fds, listen_fd >= 0 ? 3 : 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents) {
+            eventfd_t v;
+            eventfd_read(dump_fd, &v);
+            stats_dump_syslog();
+        }
+        if (listen_fd >= 0 && fds[2].revents) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                size_t n = stats_format(text, sizeof(text));
+                if (write(fd, text, n) < 0) syslog(LOG_ERR, "Stats write failed");
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+int stats_start(bool listen_socket) {
+    dump_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dump_fd < 0) {
+        syslog(LOG_ERR, "Stats eventfd failed");
+        return -1;
+    }
+
+    if (listen_socket) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, STATS_SOCKET, sizeof(addr.sun_path) - 1);
+        unlink(STATS_SOCKET);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, BACKLOG) < 0) {
+            syslog(LOG_ERR, "Stats socket setup failed");
+            stats_stop();
+            return -1;
+        }
+    }
+
+    if (pthread_create(&stats_thread, NULL, stats_loop, NULL) != 0) {
+        syslog(LOG_ERR, "Stats thread creation failed");
+        stats_stop();
+        return -1;
+    }
+    stats_running = true;
+    return 0;
+}
+
+void stats_stop(void) {
+    if (stats_running) {
+        eventfd_write(wake_fd, 1);
+        pthread_join(stats_thread, NULL);
+        stats_running = false;
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(STATS_SOCKET);
+    }
+    if (dump_fd >= 0) close(dump_fd);
+    listen_fd = dump_fd = -1;
+}
+
+void stats_request_dump(void) {
+    if (dump_fd >= 0) eventfd_write(dump_fd, 1);
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define STATS_SOCKET "/var/tmp/aesdsocket.stats"
+
+enum stat_counter {
+    STAT_CONNECTIONS,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_PACKETS,
+    STAT_REPLIES,
+    STAT_LOCK_WAITS,
+    STAT_LOCK_WAIT_NS,
+    STAT_LOG_DROPPED,
+    STAT_WAL_COMMITS,
+    STAT_LZ_RAW_BYTES,
+    STAT_LZ_STORED_BYTES,
+    STAT_COUNT,
+};
+
+// Reply latency buckets, bucket i counts replies below 2^i microseconds
+#define STATS_HIST_BUCKETS 32
+
+/**
+ * Counters owned by a single thread at a time. Only the owner writes, so
+ * updates are plain relaxed load/store pairs without a locked instruction;
+ * readers sum every block when a dump is requested.
+ */
+struct stats_block {
+    _Atomic uint64_t counters[STAT_COUNT];
+    _Atomic uint64_t reply_hist[STATS_HIST_BUCKETS];
+    atomic_bool in_use;
+    struct stats_block *next;
+};
+
+struct stats_block *stats_block_get(void);
+
+static inline void stats_add(enum stat_counter which, uint64_t n) {
+    _Atomic uint64_t *c = &stats_block_get()->counters[which];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t stats_now(void);
+
+// Record the time from packet commit to the end of its reply
+void stats_reply_done(uint64_t started_ns);
+
+// pthread_mutex_lock() that accounts for the time spent waiting
+void stats_lock(pthread_mutex_t *lock);
+
+// Render every counter and the latency histogram as text
+size_t stats_format(char *buf, size_t len);
+
+// Start the thread that serves STATS_SOCKET (when listen is set) and SIGUSR1 dumps
+int stats_start(bool listen);
+void stats_stop(void);
+
+// Async-signal-safe request for a syslog dump
+void stats_request_dump(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,115 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Options shared by every history store backend
+struct store_config {
+    /**
+     * Mirror the in-memory history to DATA_FILE from a background thread
+     */
+    bool persist;
+    /**
+     * Reply with sendfile()/splice() or MSG_ZEROCOPY instead of copying
+     */
+    bool zerocopy;
+    /**
+     * Most packets the ring store keeps, 0 for RING_MAX_PACKETS
+     */
+    size_t ring_packets;
+    /**
+     * Most bytes the ring store keeps, 0 for RING_DEFAULT_BYTES
+     */
+    size_t ring_bytes;
+    /**
+     * How long the wal store lets a batch fill before committing it, in
+     * microseconds; 0 commits as soon as the previous batch is durable
+     */
+    long wal_interval_us;
+    /**
+     * Keep the file store's history across restarts, with a packet index
+     * that also lets it seek; without it the file store cannot seek
+     */
+    bool keep_history;
+};
+
+#define RING_MAX_PACKETS 65536
+#define RING_DEFAULT_BYTES (1024 * 1024)
+
+// The wal store rolls to a new segment file every WAL_SEGMENT_BYTES
+#define WAL_SEGMENT_BYTES (64 * 1024 * 1024)
+#define WAL_MAX_SEGMENTS 16384
+// A batch this large is committed without waiting out the interval
+#define WAL_BATCH_BYTES (1024 * 1024)
+
+// The file store's packet index grows INDEX_GROW_PACKETS entries at a time
+#define INDEX_GROW_PACKETS (128 * 1024)
+#if UINTPTR_MAX > 0xffffffffu
+#define INDEX_MAX_PACKETS (256 * 1024 * 1024)
+#else
+// The index is mapped whole up front, which a 32-bit address space cannot spare 2 GiB for
+#define INDEX_MAX_PACKETS (16 * 1024 * 1024)
+#endif
+
+// The lz store compresses history LZ_BLOCK bytes at a time, and compressed replies use frames of that size
+#define LZ_BLOCK (64 * 1024)
+
+/**
+ * A history store holds every packet received so far, in arrival order.
+ * append() commits one packet atomically and reports the history length
+ * including it, snapshot() returns the committed length at this instant.
+ * send() writes part of the range [off, end) to a socket and returns the
+ * number of bytes sent, or -1 with errno set (EAGAIN on a non-blocking
+ * socket that is full); end must come from append() or snapshot().
+ * read() copies up to len committed bytes from *off into buf, for engines
+ * that hand their own buffers to the kernel.
+ * A bounded store may drop old history: send() then counts dropped bytes
+ * below end as sent, and read() moves *off past them, never beyond the
+ * original *off + len, so a reply resumes at the oldest byte still held.
+ * attach() is optional and prepares a newly accepted socket for send().
+ * seek() is optional and sets *pos to byte byte of packet packet, counted
+ * from the oldest packet held; it fails if either is out of range. Only
+ * stores that keep packet boundaries have it: ring always, file with
+ * keep_history. mem, lz and wal keep none, so seek commands against them
+ * get an empty reply, as do seeks out of range.
+ * block() is optional: when off starts a block the store keeps compressed,
+ * it points *data at the block as stored, an LZ4 block of *comp_len bytes
+ * that expands to *raw_len, or *raw_len raw bytes when *comp_len is 0.
+ * append_async() is optional, for a store whose append() sleeps until the
+ * packet is durable: it queues a copy of the packet and returns at once
+ * with *end where the packet will end. durable(end) is then 1 once it is
+ * committed, 0 while it is not, -1 if it never will be, and commit_fd() is
+ * an eventfd the store writes after every commit, for event loops to wait
+ * on. Engines that must not block use these instead of append().
+ * Writers serialize inside the store, readers of a committed range never
+ * take the write lock, so a slow reader cannot stall anyone else.
+ */
+struct store_ops {
+    const char *name;
+    int (*open)(const struct store_config *cfg);
+    int (*append)(const char *buf, size_t len, size_t *end);
+    ssize_t (*send)(int sock, size_t off, size_t end);
+    size_t (*snapshot)(void);
+    ssize_t (*read)(char *buf, size_t *off, size_t len);
+    void (*attach)(int sock);
+    int (*seek)(size_t packet, size_t byte, size_t *pos);
+    int (*block)(size_t off, const char **data, size_t *raw_len, size_t *comp_len);
+    int (*append_async)(const char *buf, size_t len, size_t *end);
+    int (*durable)(size_t end);
+    int (*commit_fd)(void);
+    void (*close)(void);
+};
+
+extern const struct store_ops file_store_ops;
+extern const struct store_ops mem_store_ops;
+extern const struct store_ops ring_store_ops;
+extern const struct store_ops wal_store_ops;
+extern const struct store_ops lz_store_ops;
+
+// Backend selected on the command line
+extern const struct store_ops *store;
+
+#endif /* STORE_H */
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "stats.h"
+
+#define SEND_CHUNK 16384
+#define SPLICE_CHUNK (64 * 1024)
+#define INDEX_MAGIC "AESDIDX1"
+
+/**
+ * Side index of packet boundaries kept in INDEX_FILE next to DATA_FILE
+ * when the history is kept across restarts (-k): a header, then the
+ * history offset each packet ends at. The file is
+ * mapped once over room for INDEX_MAX_PACKETS entries and grown with
+ * ftruncate() underneath the mapping, so the address never moves and
+ * seek() reads it without a lock. An entry is written before count
+ * covers it, and only for bytes already committed.
+ */
+struct file_index {
+    char magic[8];
+    _Atomic uint64_t count;
+    uint64_t end[];
+};
+
+static bool zerocopy;
+// Set by whichever client thread first finds sendfile() refused
+static atomic_bool use_splice;
+static _Atomic size_t committed;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set when a partial write could not be undone; guarded by write_lock
+static bool write_broken;
+static int index_fd = -1;
+static struct file_index *index_map;
+// Entries the index file has room for; guarded by write_lock
+static size_t index_cap;
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+static void pipe_free(void *arg) {
+    int *fds = arg;
+    close(fds[0]);
+    close(fds[1]);
+    free(fds);
+}
+
+static void pipe_key_init(void) {
+    pthread_key_create(&pipe_key, pipe_free);
+}
+
+// Per-thread pipe used to splice the file into the socket
+static int *thread_pipe(void) {
+    pthread_once(&pipe_once, pipe_key_init);
+
+    int *fds = pthread_getspecific(pipe_key);
+    if (fds) return fds;
+
+    fds = malloc(2 * sizeof(int));
+    if (!fds) return NULL;
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        free(fds);
+        return NULL;
+    }
+    pthread_setspecific(pipe_key, fds);
+    return fds;
+}
+
+// Fallback for kernels or files where sendfile() is refused
+static ssize_t file_splice(int sock, size_t off, size_t end) {
+    int *fds = thread_pipe();
+    size_t want = end - off;
+    loff_t pos = off;
+
+    if (!fds) return -1;
+    if (want > SPLICE_CHUNK) want = SPLICE_CHUNK;
+
+    ssize_t in = splice(data_fd, &pos, fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in <= 0) return -1;
+
+    ssize_t out = splice(fds[0], NULL, sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    int saved = errno;
+
+    // Whatever the socket did not take is stale for the next call, drop it
+    if (out < in) {
+        char drain[SEND_CHUNK];
+        ssize_t left = in - (out > 0 ? out : 0);
+        while (left > 0) {
+            ssize_t n = read(fds[0], drain, left < (ssize_t)sizeof(drain) ? left : (ssize_t)sizeof(drain));
+            if (n <= 0) break;
+            left -= n;
+        }
+    }
+    errno = saved;
+    return out;
+}
+
+static ssize_t file_sendfile(int sock, size_t off, size_t end) {
+    off_t pos = off;
+
+    if (!atomic_load_explicit(&use_splice, memory_order_relaxed)) {
+        ssize_t sent = sendfile(sock, data_fd, &pos, end - off);
+        if (sent >= 0 || (errno != EINVAL && errno != ENOSYS)) return sent;
+        syslog(LOG_INFO, "sendfile unavailable, falling back to splice");
+        atomic_store_explicit(&use_splice, true, memory_order_relaxed);
+    }
+    return file_splice(sock, off, end);
+}
+
+static size_t index_bytes(size_t entries) {
+    return sizeof(struct file_index) + entries * sizeof(uint64_t);
+}
+
+// Grow the index file so entry count fits; caller holds write_lock
+static int index_reserve(size_t count) {
+    if (count < index_cap) return 0;
+    if (count >= INDEX_MAX_PACKETS) {
+        syslog(LOG_ERR, "Packet index is full at %d packets", INDEX_MAX_PACKETS);
+        return -1;
+    }
+
+    size_t cap = (count / INDEX_GROW_PACKETS + 1) * INDEX_GROW_PACKETS;
+    if (cap > INDEX_MAX_PACKETS) cap = INDEX_MAX_PACKETS;
+    if (ftruncate(index_fd, index_bytes(cap)) < 0) {
+        syslog(LOG_ERR, "Growing the packet index failed: %s", strerror(errno));
+        return -1;
+    }
+    index_cap = cap;
+    return 0;
+}
+
+// Record a packet ending at history offset end; caller holds write_lock
+static int index_push(size_t end) {
+    uint64_t count = atomic_load_explicit(&index_map->count, memory_order_relaxed);
+
+    if (index_reserve(count) < 0) return -1;
+    index_map->end[count] = end;
+    atomic_store_explicit(&index_map->count, count + 1, memory_order_release);
+    return 0;
+}
+
+// Map INDEX_FILE, starting an empty index if it is missing or not one
+static int index_open(void) {
+    struct stat st;
+
+    index_fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd < 0 || fstat(index_fd, &st) < 0) {
+        syslog(LOG_ERR, "Opening %s failed: %s", INDEX_FILE, strerror(errno));
+        return -1;
+    }
+    index_map = mmap(NULL, index_bytes(INDEX_MAX_PACKETS), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (index_map == MAP_FAILED) {
+        index_map = NULL;
+        syslog(LOG_ERR, "Mapping %s failed: %s", INDEX_FILE, strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)st.st_size >= sizeof(struct file_index) &&
+        memcmp(index_map->magic, INDEX_MAGIC, sizeof(index_map->magic)) == 0) {
+        index_cap = ((size_t)st.st_size - sizeof(struct file_index)) / sizeof(uint64_t);
+        if (index_cap > INDEX_MAX_PACKETS) index_cap = INDEX_MAX_PACKETS;
+        // A count past the end of a cut index file covers nothing
+        if (atomic_load(&index_map->count) > index_cap) atomic_store(&index_map->count, index_cap);
+        return 0;
+    }
+
+    index_cap = 0;
+    if (ftruncate(index_fd, 0) < 0 || index_reserve(0) < 0) {
+        syslog(LOG_ERR, "Creating %s failed: %s", INDEX_FILE, strerror(errno));
+        return -1;
+    }
+    memcpy(index_map->magic, INDEX_MAGIC, sizeof(index_map->magic));
+    atomic_store(&index_map->count, 0);
+    return 0;
+}
+
+/**
+ * Match the index to the size bytes of DATA_FILE: drop entries past the
+ * end, index packets written after the last entry, and cut an unfinished
+ * packet off the tail. Of the data only the pages past the last entry are
+ * read; an index whose entries do not rise, or that does not end on a
+ * packet boundary, is rebuilt from the whole file.
+ * @return the committed history length, or -1
+ */
+static ssize_t index_recover(size_t size) {
+    uint64_t count = atomic_load(&index_map->count);
+    const char *data = NULL;
+    uint64_t prev = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (index_map->end[i] <= prev) {
+            syslog(LOG_INFO, "Packet index is corrupt, rebuilding it");
+            count = 0;
+            break;
+        }
+        if (index_map->end[i] > size) {
+            count = i;
+            break;
+        }
+        prev = index_map->end[i];
+    }
+    // Every entry left is above 0 and at most size, so data is mapped whenever one is
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_SHARED, data_fd, 0);
+        if (data == MAP_FAILED) {
+            syslog(LOG_ERR, "Mapping %s failed: %s", DATA_FILE, strerror(errno));
+            return -1;
+        }
+    }
+    if (count > 0 && data[index_map->end[count - 1] - 1] != '\n') {
+        syslog(LOG_INFO, "Packet index does not match %s, rebuilding it", DATA_FILE);
+        count = 0;
+    }
+    atomic_store(&index_map->count, count);
+
+    size_t pos = count > 0 ? index_map->end[count - 1] : 0;
+    const char *nl;
+    if (pos < size) madvise((char*)data + pos, size - pos, MADV_SEQUENTIAL);
+    while (pos < size && (nl = memchr(data + pos, '\n', size - pos)) != NULL) {
+        pos = nl - data + 1;
+        if (index_push(pos) < 0) {
+            munmap((char*)data, size);
+            return -1;
+        }
+    }
+    if (data) munmap((char*)data, size);
+
+    if (pos < size) {
+        syslog(LOG_INFO, "Dropping %zu bytes of an unfinished packet from %s", size - pos, DATA_FILE);
+        if (ftruncate(data_fd, pos) < 0) {
+            syslog(LOG_ERR, "Truncating %s failed: %s", DATA_FILE, strerror(errno));
+            return -1;
+        }
+    }
+    return pos;
+}
+
+static int file_open(const struct store_config *cfg) {
+    struct timespec start, done;
+    struct stat st;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    zerocopy = cfg->zerocopy;
+    data_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (data_fd < 0 || fstat(data_fd, &st) < 0) {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+    if (!cfg->keep_history) {
+        atomic_store(&committed, st.st_size);
+        return 0;
+    }
+    if (index_open() < 0) return -1;
+
+    ssize_t size = index_recover(st.st_size);
+    if (size < 0) return -1;
+    atomic_store(&committed, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    if (size > 0) {
+        syslog(LOG_INFO, "Opened %llu packets, %zd bytes of history in %.1f ms",
+               (unsigned long long)atomic_load(&index_map->count), size,
+               (done.tv_sec - start.tv_sec) * 1e3 + (done.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    return 0;
+}
+
+/**
+ * Write a whole packet at the end of DATA_FILE, or none of it: a failed
+ * write is cut back off, so the next packet never continues a partial one.
+ * Once that fails too the file no longer matches committed, and every
+ * later append is refused. Caller holds write_lock.
+ */
+static int file_write(const char *buf, size_t len) {
+    size_t start = atomic_load_explicit(&committed, memory_order_relaxed);
+    size_t done = 0;
+
+    if (write_broken) return -1;
+    while (done < len) {
+        ssize_t wr = write(data_fd, buf + done, len - done);
+        if (wr < 0 && errno == EINTR) continue;
+        if (wr <= 0) {
+            syslog(LOG_ERR, "Write failed: %s", wr < 0 ? strerror(errno) : "no progress");
+            if (done > 0 && ftruncate(data_fd, start) < 0) {
+                syslog(LOG_ERR, "Cutting a partial packet off %s failed, refusing writes", DATA_FILE);
+                write_broken = true;
+            }
+            return -1;
+        }
+        done += wr;
+    }
+    atomic_store_explicit(&committed, start + len, memory_order_release);
+    return 0;
+}
+
+static int file_append(const char *buf, size_t len, size_t *end) {
+    int rc;
+
+    stats_lock(&write_lock);
+    // Room for the entry first, so a packet on disk is never left out of the index
+    if (index_map && index_reserve(atomic_load_explicit(&index_map->count, memory_order_relaxed)) < 0) {
+        rc = -1;
+    } else {
+        rc = file_write(buf, len);
+    }
+    *end = atomic_load_explicit(&committed, memory_order_relaxed);
+    if (rc == 0 && index_map) index_push(*end);
+    pthread_mutex_unlock(&write_lock);
+    return rc;
+}
+
+static size_t file_snapshot(void) {
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+// Bytes below a committed end never change, so no lock is needed to read them
+static ssize_t file_send(int sock, size_t off, size_t end) {
+    char chunk[SEND_CHUNK];
+    size_t want = end - off;
+
+    if (zerocopy) return file_sendfile(sock, off, end);
+    if (want > sizeof(chunk)) want = sizeof(chunk);
+
+    ssize_t got = pread(data_fd, chunk, want, off);
+    if (got <= 0) {
+        syslog(LOG_ERR, "Read failed");
+        return -1;
+    }
+    return send(sock, chunk, got, MSG_NOSIGNAL);
+}
+
+static ssize_t file_read(char *buf, size_t *off, size_t len) {
+    return pread(data_fd, buf, len, *off);
+}
+
+// Packets are counted from the first one, which the file store never drops
+static int file_seek(size_t packet, size_t byte, size_t *pos) {
+    if (!index_map) return -1;
+
+    uint64_t count = atomic_load_explicit(&index_map->count, memory_order_acquire);
+
+    if (packet >= count) return -1;
+    size_t start = packet > 0 ? index_map->end[packet - 1] : 0;
+    if (byte >= index_map->end[packet] - start) return -1;
+    *pos = start + byte;
+    return 0;
+}
+
+static void file_close(void) {
+    if (index_map) {
+        // Give back the room reserved past the last entry
+        if (ftruncate(index_fd, index_bytes(atomic_load(&index_map->count))) < 0) {
+            syslog(LOG_ERR, "Trimming %s failed: %s", INDEX_FILE, strerror(errno));
+        }
+        munmap(index_map, index_bytes(INDEX_MAX_PACKETS));
+    }
+    index_map = NULL;
+    index_cap = 0;
+    if (index_fd >= 0) close(index_fd);
+    index_fd = -1;
+    if (data_fd >= 0) close(data_fd);
+    data_fd = -1;
+    write_broken = false;
+}
+
+const struct store_ops file_store_ops = {
+    .name = "file",
+    .open = file_open,
+    .append = file_append,
+    .send = file_send,
+    .snapshot = file_snapshot,
+    .read = file_read,
+    .seek = file_seek,
+    .close = file_close,
+};
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "stats.h"
+#include "lz4block.h"
+
+#define SEND_CHUNK 16384
+// Two-level block directory; leaves are never moved, so readers need no lock
+#define DIR_LEAF 1024
+#define DIR_ROOT 4096
+
+/**
+ * Compressed history: bytes collect in a raw tail block, and every
+ * LZ_BLOCK bytes the full tail is sealed, compressed with LZ4 into its
+ * own allocation. Sealed blocks never change, so readers decompress them
+ * without a lock; each thread keeps the last block it decompressed, so a
+ * reply walking the history expands every block once. Only reading the
+ * tail takes tail_lock, shared, because sealing reuses the tail buffer.
+ */
+struct lz_block {
+    /**
+     * LZ4 block, or the raw bytes when compressing did not shrink them
+     */
+    char *data;
+    /**
+     * Length of data, 0 when data holds LZ_BLOCK raw bytes
+     */
+    uint32_t comp_len;
+};
+
+static struct lz_block *block_dir[DIR_ROOT];
+static char *tail;
+// First byte of the tail; every block below it is sealed
+static size_t tail_base;
+static pthread_rwlock_t tail_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Bytes below committed are immutable; total only moves under write_lock
+static _Atomic size_t committed;
+static size_t total;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+// Free sealing buffers chained through their first bytes, guarded by write_lock
+static char *spare_head;
+static size_t nspare;
+
+struct lz_cache {
+    size_t idx;
+    char raw[LZ_BLOCK];
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_key_init(void) {
+    pthread_key_create(&cache_key, free);
+}
+
+static inline struct lz_block *lz_entry(size_t idx) {
+    return &block_dir[idx / DIR_LEAF][idx % DIR_LEAF];
+}
+
+// Raw bytes of sealed block idx, decompressed into this thread's cache when needed
+static const char *lz_block_raw(size_t idx) {
+    struct lz_block *b = lz_entry(idx);
+
+    if (b->comp_len == 0) return b->data;
+
+    pthread_once(&cache_once, cache_key_init);
+    struct lz_cache *cache = pthread_getspecific(cache_key);
+    if (!cache) {
+        cache = malloc(sizeof(*cache));
+        if (!cache) return NULL;
+        cache->idx = SIZE_MAX;
+        pthread_setspecific(cache_key, cache);
+    }
+    if (cache->idx != idx) {
+        if (lz4_decompress_block(b->data, b->comp_len, cache->raw, LZ_BLOCK) != LZ_BLOCK) {
+            syslog(LOG_ERR, "History block %zu is corrupt", idx);
+            cache->idx = SIZE_MAX;
+            return NULL;
+        }
+        cache->idx = idx;
+    }
+    return cache->raw;
+}
+
+// Caller holds write_lock; set aside what sealing the blocks that len more bytes fill needs
+static int lz_reserve(size_t len) {
+    size_t seals = (total % LZ_BLOCK + len) / LZ_BLOCK;
+    size_t blocks = (total + len) / LZ_BLOCK;
+
+    if (seals == 0) return 0;
+    if (blocks > (size_t)DIR_ROOT * DIR_LEAF) return -1;
+    for (size_t leaf = tail_base / LZ_BLOCK / DIR_LEAF; leaf <= (blocks - 1) / DIR_LEAF; leaf++) {
+        if (!block_dir[leaf]) {
+            block_dir[leaf] = calloc(DIR_LEAF, sizeof(struct lz_block));
+            if (!block_dir[leaf]) return -1;
+        }
+    }
+    while (nspare < seals) {
+        char *buf = malloc(LZ4_BLOCK_BOUND(LZ_BLOCK));
+        if (!buf) return -1;
+        *(char**)buf = spare_head;
+        spare_head = buf;
+        nspare++;
+    }
+    return 0;
+}
+
+/**
+ * Compress the full tail into a sealed block and start the next one, out
+ * of what lz_reserve() set aside. Caller holds write_lock; the tail is
+ * only swapped under tail_lock.
+ */
+static void lz_seal(void) {
+    size_t idx = tail_base / LZ_BLOCK;
+    char *packed = spare_head, *data, *next;
+
+    spare_head = *(char**)packed;
+    nspare--;
+
+    size_t comp_len = lz4_compress_block(tail, LZ_BLOCK, packed, LZ4_BLOCK_BOUND(LZ_BLOCK));
+    if (comp_len > 0 && comp_len < LZ_BLOCK) {
+        data = realloc(packed, comp_len);
+        if (!data) data = packed;
+        next = tail;
+    } else {
+        // Keep the raw block as it is; the spare, being larger, becomes the next tail
+        data = tail;
+        comp_len = 0;
+        next = packed;
+    }
+
+    pthread_rwlock_wrlock(&tail_lock);
+    *lz_entry(idx) = (struct lz_block){ data, comp_len };
+    tail_base += LZ_BLOCK;
+    tail = next;
+    pthread_rwlock_unlock(&tail_lock);
+
+    stats_add(STAT_LZ_RAW_BYTES, LZ_BLOCK);
+    stats_add(STAT_LZ_STORED_BYTES, comp_len ? comp_len : LZ_BLOCK);
+}
+
+static int lz_open(const struct store_config *cfg) {
+    tail = malloc(LZ_BLOCK);
+    if (!tail) {
+        syslog(LOG_ERR, "History allocation failed");
+        return -1;
+    }
+    return 0;
+}
+
+// A packet becomes visible to readers all at once when committed is published
+static int lz_append(const char *buf, size_t len, size_t *end) {
+    stats_lock(&write_lock);
+
+    if (lz_reserve(len) < 0) {
+        syslog(LOG_ERR, "History allocation failed");
+        *end = total;
+        pthread_mutex_unlock(&write_lock);
+        return -1;
+    }
+
+    while (len > 0) {
+        size_t in_block = total % LZ_BLOCK;
+        size_t n = LZ_BLOCK - in_block;
+        if (n > len) n = len;
+        memcpy(tail + in_block, buf, n);
+        total += n;
+        buf += n;
+        len -= n;
+        if (total % LZ_BLOCK == 0) lz_seal();
+    }
+
+    atomic_store_explicit(&committed, total, memory_order_release);
+    *end = total;
+    pthread_mutex_unlock(&write_lock);
+    return 0;
+}
+
+static size_t lz_snapshot(void) {
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+/**
+ * Bytes from off up to the end of its block, at most len: set *raw to them
+ * in place when the block is sealed, else copy at most cap into dst
+ * @return the number of bytes, or -1 on a corrupt block
+ */
+static ssize_t lz_chunk(char *dst, size_t cap, const char **raw, size_t off, size_t len) {
+    size_t in_block = off % LZ_BLOCK;
+
+    if (len > LZ_BLOCK - in_block) len = LZ_BLOCK - in_block;
+
+    pthread_rwlock_rdlock(&tail_lock);
+    if (off >= tail_base) {
+        if (len > cap) len = cap;
+        memcpy(dst, tail + in_block, len);
+        pthread_rwlock_unlock(&tail_lock);
+        *raw = dst;
+        return len;
+    }
+    pthread_rwlock_unlock(&tail_lock);
+
+    const char *block = lz_block_raw(off / LZ_BLOCK);
+    if (!block) return -1;
+    *raw = block + in_block;
+    return len;
+}
+
+// Sealed blocks go out straight from the thread's cache, tail bytes through chunk
+static ssize_t lz_send(int sock, size_t off, size_t end) {
+    char chunk[SEND_CHUNK];
+    const char *raw;
+
+    ssize_t got = lz_chunk(chunk, sizeof(chunk), &raw, off, end - off);
+    if (got < 0) return -1;
+    return send(sock, raw, got, MSG_NOSIGNAL);
+}
+
+static ssize_t lz_read(char *buf, size_t *off, size_t len) {
+    size_t copied = 0;
+
+    while (copied < len) {
+        const char *raw;
+        ssize_t got = lz_chunk(buf + copied, len - copied, &raw, *off + copied, len - copied);
+        if (got < 0) return copied ? (ssize_t)copied : -1;
+        if (raw != buf + copied) memcpy(buf + copied, raw, got);
+        copied += got;
+    }
+    return copied;
+}
+
+// Sealed blocks are handed out as they are stored, so compressed replies never recompress them
+static int lz_block(size_t off, const char **data, size_t *raw_len, size_t *comp_len) {
+    bool sealed;
+
+    pthread_rwlock_rdlock(&tail_lock);
+    sealed = off < tail_base;
+    pthread_rwlock_unlock(&tail_lock);
+    if (!sealed || off % LZ_BLOCK != 0) return -1;
+
+    struct lz_block *b = lz_entry(off / LZ_BLOCK);
+    *data = b->data;
+    *raw_len = LZ_BLOCK;
+    *comp_len = b->comp_len;
+    return 0;
+}
+
+// Replies go out in several send() calls; without this the last one waits for a delayed ACK
+static void lz_attach(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void lz_close(void) {
+    for (size_t i = 0; i < tail_base / LZ_BLOCK; i++) {
+        free(lz_entry(i)->data);
+    }
+    for (size_t i = 0; i < DIR_ROOT && block_dir[i]; i++) {
+        free(block_dir[i]);
+        block_dir[i] = NULL;
+    }
+    free(tail);
+    tail = NULL;
+    while (spare_head) {
+        char *next = *(char**)spare_head;
+        free(spare_head);
+        spare_head = next;
+    }
+    nspare = 0;
+    tail_base = total = 0;
+    atomic_store(&committed, 0);
+}
+
+const struct store_ops lz_store_ops = {
+    .name = "lz",
+    .open = lz_open,
+    .append = lz_append,
+    .send = lz_send,
+    .snapshot = lz_snapshot,
+    .read = lz_read,
+    .attach = lz_attach,
+    .block = lz_block,
+    .close = lz_close,
+};
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "stats.h"
+
+// History lives in fixed-size chunks, so byte N is always in chunk N / MEM_CHUNK
+#define MEM_CHUNK (64 * 1024)
+// Two-level chunk directory; leaves are never moved, so readers need no lock
+#define DIR_LEAF 1024
+#define DIR_ROOT 4096
+#define MAX_IOV 64
+// Below this the page pinning of MSG_ZEROCOPY costs more than the copy it saves
+#define ZEROCOPY_MIN (16 * 1024)
+
+static char **chunk_dir[DIR_ROOT];
+static size_t nchunks;
+static bool zerocopy;
+
+// Bytes below committed are immutable; total only moves under write_lock
+static _Atomic size_t committed;
+static size_t total;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write-behind state, guarded by write_lock
+static bool persist;
+static bool wb_stop;
+static size_t persisted;
+static pthread_t wb_thread;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+
+static inline char *mem_chunk(size_t idx) {
+    return chunk_dir[idx / DIR_LEAF][idx % DIR_LEAF];
+}
+
+// Caller holds write_lock
+static int mem_grow(void) {
+    size_t root = nchunks / DIR_LEAF;
+
+    if (root >= DIR_ROOT) return -1;
+    if (!chunk_dir[root]) {
+        chunk_dir[root] = calloc(DIR_LEAF, sizeof(char*));
+        if (!chunk_dir[root]) return -1;
+    }
+    chunk_dir[root][nchunks % DIR_LEAF] = malloc(MEM_CHUNK);
+    if (!chunk_dir[root][nchunks % DIR_LEAF]) return -1;
+    nchunks++;
+    return 0;
+}
+
+// Collect iovecs covering [off, end); end must not exceed a committed length
+static int mem_iov(struct iovec *iov, int max, size_t off, size_t end) {
+    int n = 0;
+
+    while (off < end && n < max) {
+        size_t in_chunk = off % MEM_CHUNK;
+        size_t len = MEM_CHUNK - in_chunk;
+        if (len > end - off) len = end - off;
+        iov[n].iov_base = mem_chunk(off / MEM_CHUNK) + in_chunk;
+        iov[n].iov_len = len;
+        off += len;
+        n++;
+    }
+    return n;
+}
+
+// Drain newly committed bytes to DATA_FILE off the request path
+static void* mem_writeback(void* arg) {
+    struct iovec iov[MAX_IOV];
+
+    pthread_mutex_lock(&write_lock);
+    for (;;) {
+        while (!wb_stop && persisted == total) {
+            pthread_cond_wait(&wb_cond, &write_lock);
+        }
+        if (persisted == total) break;
+
+        size_t end = total;
+        pthread_mutex_unlock(&write_lock);
+
+        int n = mem_iov(iov, MAX_IOV, persisted, end);
+        ssize_t wr = writev(data_fd, iov, n);
+
+        pthread_mutex_lock(&write_lock);
+        if (wr < 0) {
+            syslog(LOG_ERR, "Write-behind failed: %s", strerror(errno));
+            break;
+        }
+        persisted += wr;
+    }
+    pthread_mutex_unlock(&write_lock);
+    return NULL;
+}
+
+static int mem_open(const struct store_config *cfg) {
+    zerocopy = cfg->zerocopy;
+    persist = cfg->persist;
+    if (!persist) return 0;
+
+    data_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (data_fd < 0) {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+    if (pthread_create(&wb_thread, NULL, mem_writeback, NULL) != 0) {
+        syslog(LOG_ERR, "Write-behind thread creation failed");
+        persist = false;
+        return -1;
+    }
+    return 0;
+}
+
+// A packet becomes visible to readers all at once when committed is published
+static int mem_append(const char *buf, size_t len, size_t *end) {
+    stats_lock(&write_lock);
+
+    size_t pos = total;
+    while (pos + len > nchunks * MEM_CHUNK) {
+        if (mem_grow() < 0) {
+            syslog(LOG_ERR, "History allocation failed");
+            *end = total;
+            pthread_mutex_unlock(&write_lock);
+            return -1;
+        }
+    }
+
+    while (len > 0) {
+        size_t in_chunk = pos % MEM_CHUNK;
+        size_t n = MEM_CHUNK - in_chunk;
+        if (n > len) n = len;
+        memcpy(mem_chunk(pos / MEM_CHUNK) + in_chunk, buf, n);
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+
+    total = pos;
+    atomic_store_explicit(&committed, pos, memory_order_release);
+    *end = pos;
+    if (persist) pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&write_lock);
+    return 0;
+}
+
+static size_t mem_snapshot(void) {
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+// Completions only report that pages were released; chunks outlive the socket
+static void mem_reap_zerocopy(int sock) {
+    char control[128];
+    struct msghdr msg = { .msg_control = control };
+
+    do {
+        msg.msg_controllen = sizeof(control);
+    } while (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+}
+
+// Committed chunks are never moved or rewritten, so readers take no lock
+static ssize_t mem_send(int sock, size_t off, size_t end) {
+    struct iovec iov[MAX_IOV];
+    struct msghdr msg = { .msg_iov = iov };
+    int flags = MSG_NOSIGNAL;
+
+    msg.msg_iovlen = mem_iov(iov, MAX_IOV, off, end);
+
+    if (zerocopy && end - off >= ZEROCOPY_MIN) {
+        ssize_t sent = sendmsg(sock, &msg, flags | MSG_ZEROCOPY);
+        mem_reap_zerocopy(sock);
+        if (sent >= 0 || errno != ENOBUFS) return sent;
+    }
+    return sendmsg(sock, &msg, flags);
+}
+
+static ssize_t mem_read(char *buf, size_t *off, size_t len) {
+    struct iovec iov[MAX_IOV];
+    int n = mem_iov(iov, MAX_IOV, *off, *off + len);
+    ssize_t copied = 0;
+
+    for (int i = 0; i < n; i++) {
+        memcpy(buf + copied, iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+    return copied;
+}
+
+static void mem_attach(int sock) {
+    int one = 1;
+
+    if (zerocopy && setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        syslog(LOG_INFO, "SO_ZEROCOPY unavailable on fd %d, copying replies", sock);
+    }
+}
+
+static void mem_close(void) {
+    if (persist) {
+        pthread_mutex_lock(&write_lock);
+        wb_stop = true;
+        pthread_cond_signal(&wb_cond);
+        pthread_mutex_unlock(&write_lock);
+        pthread_join(wb_thread, NULL);
+        persist = false;
+    }
+    if (data_fd >= 0) close(data_fd);
+    data_fd = -1;
+
+    for (size_t i = 0; i < nchunks; i++) {
+        free(mem_chunk(i));
+    }
+    for (size_t i = 0; i < DIR_ROOT && chunk_dir[i]; i++) {
+        free(chunk_dir[i]);
+        chunk_dir[i] = NULL;
+    }
+    nchunks = total = persisted = 0;
+    atomic_store(&committed, 0);
+}
+
+const struct store_ops mem_store_ops = {
+    .name = "mem",
+    .open = mem_open,
+    .append = mem_append,
+    .send = mem_send,
+    .snapshot = mem_snapshot,
+    .read = mem_read,
+    .attach = mem_attach,
+    .close = mem_close,
+};
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesdsocket.h"
+#include "store.h"
+#include "stats.h"
+
+#define RING_CHUNK 16384
+#define MAX_IOV 64
+
+/**
+ * Bounded history: the last packets live in an aesd_circular_buffer that
+ * owns their bytes in an arena, so memory and reply size stop growing once
+ * either limit is reached. Positions are the buffer's stream positions; the
+ * oldest packets are evicted as new ones arrive, and a reply that falls
+ * behind eviction continues from the oldest byte still held. Only writers
+ * take the lock. The arena is reused in place, so the writer makes seq odd
+ * while it evicts and copies, and readers copy out one RING_CHUNK at a time
+ * without the lock, trying again whenever seq moved under them.
+ */
+static struct aesd_circular_buffer history;
+static struct aesd_buffer_entry *slots;
+static size_t *slot_pos;
+static char *arena;
+static _Atomic size_t committed;
+static _Atomic unsigned seq;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_open(const struct store_config *cfg) {
+    size_t packets = cfg->ring_packets ? cfg->ring_packets : RING_MAX_PACKETS;
+    size_t bytes = cfg->ring_bytes ? cfg->ring_bytes : RING_DEFAULT_BYTES;
+    size_t nslots = AESD_CIRCULAR_BUFFER_SLOTS(packets);
+
+    slots = malloc(nslots * sizeof(*slots));
+    slot_pos = malloc(nslots * sizeof(*slot_pos));
+    arena = malloc(bytes);
+    if (!slots || !slot_pos || !arena) {
+        syslog(LOG_ERR, "History allocation failed");
+        return -1;
+    }
+    if (aesd_circular_buffer_init_storage(&history, slots, slot_pos, nslots, packets) != 0 ||
+        aesd_circular_buffer_init_arena(&history, arena, bytes) != 0) {
+        syslog(LOG_ERR, "Invalid history limits: %zu packets, %zu bytes", packets, bytes);
+        return -1;
+    }
+    syslog(LOG_INFO, "Keeping the last %zu packets, up to %zu bytes", packets, bytes);
+    return 0;
+}
+
+// A packet larger than the arena keeps only its last bytes
+static int ring_append(const char *buf, size_t len, size_t *end) {
+    stats_lock(&lock);
+    if (len > history.arena_size) {
+        buf += len - history.arena_size;
+        len = history.arena_size;
+    }
+    unsigned s = atomic_load_explicit(&seq, memory_order_relaxed);
+    atomic_store_explicit(&seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    aesd_circular_buffer_append(&history, buf, len);
+    atomic_store_explicit(&seq, s + 2, memory_order_release);
+    *end = history.total_size;
+    atomic_store_explicit(&committed, history.total_size, memory_order_release);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static size_t ring_snapshot(void) {
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+// Wait out a writer in progress, returning the seq to check against in read_retry()
+static unsigned read_begin(void) {
+    unsigned s;
+
+    while ((s = atomic_load_explicit(&seq, memory_order_acquire)) & 1) sched_yield();
+    return s;
+}
+
+// Whether a writer ran since read_begin(), so whatever was read may be torn
+static bool read_retry(unsigned s) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&seq, memory_order_relaxed) != s;
+}
+
+// Position of the oldest byte held; caller is between read_begin() and read_retry()
+static size_t ring_base(void) {
+    if (history.in_offs == history.out_offs) return history.total_size;
+    return history.entry_pos[history.out_offs & history.mask];
+}
+
+/**
+ * Copy up to len bytes of [*off, end) into dst, first moving *off up to the
+ * oldest byte held if it was evicted; caller is between read_begin() and
+ * read_retry(). A writer may tear the entries it reads, so nothing outside
+ * the arena is copied and the result only counts if read_retry() is false.
+ */
+static size_t ring_copy(char *dst, size_t *off, size_t end, size_t len) {
+    struct iovec iov[MAX_IOV];
+    size_t base = ring_base();
+    size_t n, copied = 0;
+
+    if (*off < base) *off = base < end ? base : end;
+    if (len > end - *off) len = end - *off;
+
+    // Fill the whole chunk even across many small packets, one send() per chunk
+    while (copied < len) {
+        size_t got = aesd_circular_buffer_read_iov(&history, *off - base + copied, len - copied,
+                                                   iov, MAX_IOV, &n);
+        if (got == 0) break;
+        for (size_t i = 0; i < n; i++) {
+            const char *from = iov[i].iov_base;
+            if (from < arena || from > arena + history.arena_size ||
+                iov[i].iov_len > (size_t)(arena + history.arena_size - from)) {
+                return copied;
+            }
+            memcpy(dst + copied, iov[i].iov_base, iov[i].iov_len);
+            copied += iov[i].iov_len;
+        }
+    }
+    return copied;
+}
+
+// Evicted bytes count as sent, so callers simply resume at off + the result
+static ssize_t ring_send(int sock, size_t off, size_t end) {
+    char chunk[RING_CHUNK];
+    size_t from, copied;
+    unsigned s;
+
+    do {
+        s = read_begin();
+        from = off;
+        copied = ring_copy(chunk, &from, end, sizeof(chunk));
+    } while (read_retry(s));
+
+    if (copied == 0) return from - off;
+
+    ssize_t sent = send(sock, chunk, copied, MSG_NOSIGNAL);
+    if (sent < 0) return -1;
+    return from - off + sent;
+}
+
+static ssize_t ring_read(char *buf, size_t *off, size_t len) {
+    size_t from, copied;
+    unsigned s;
+
+    do {
+        s = read_begin();
+        from = *off;
+        copied = ring_copy(buf, &from, from + len, len);
+    } while (read_retry(s));
+    *off = from;
+    return copied;
+}
+
+/**
+ * Packets are counted from the oldest one held, as the char driver's seek
+ * does; the position is only good if find_entry_offset_for_fpos() maps it
+ * back to byte byte of that same packet
+ */
+static int ring_seek(size_t packet, size_t byte, size_t *pos) {
+    struct aesd_buffer_entry *entry;
+    size_t at = 0, base, rel, within;
+    unsigned s;
+    int rc;
+
+    do {
+        s = read_begin();
+        rc = -1;
+        if (packet < history.in_offs - history.out_offs) {
+            size_t idx = (history.out_offs + packet) & history.mask;
+            base = ring_base();
+            rel = history.entry_pos[idx] - base + byte;
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&history, rel, &within);
+            if (entry == &history.entry[idx] && within == byte) {
+                at = base + rel;
+                rc = 0;
+            }
+        }
+    } while (read_retry(s));
+    if (rc == 0) *pos = at;
+    return rc;
+}
+
+// Replies go out in several send() calls; without this the last one waits for a delayed ACK
+static void ring_attach(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void ring_close(void) {
+    free(slots);
+    free(slot_pos);
+    free(arena);
+    slots = NULL;
+    slot_pos = NULL;
+    arena = NULL;
+    atomic_store(&committed, 0);
+    atomic_store(&seq, 0);
+}
+
+const struct store_ops ring_store_ops = {
+    .name = "ring",
+    .open = ring_open,
+    .append = ring_append,
+    .send = ring_send,
+    .snapshot = ring_snapshot,
+    .read = ring_read,
+    .attach = ring_attach,
+    .seek = ring_seek,
+    .close = ring_close,
+};
@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "stats.h"
+
+#define SEND_CHUNK 16384
+#define WAL_IOV 1024
+#define SCAN_CHUNK 4096
+
+/**
+ * Durable history: packets go to a write-ahead log of WAL_SEGMENT_BYTES
+ * files in WAL_DIR, so byte N lives in segment N / WAL_SEGMENT_BYTES and a
+ * packet may span two segments. append() only queues a pointer to the
+ * caller's packet and sleeps; a single commit thread writes everything
+ * queued by all clients with pwritev(), makes it durable with one
+ * fdatasync() per segment touched, and then wakes the whole batch. A
+ * client is answered only once its packet is on disk, and readers only
+ * see committed bytes, which never change again. Event loops queue a copy
+ * with append_async() instead, and hear of each commit on commit_efd.
+ */
+struct wal_req {
+    const char *buf;
+    size_t len;
+    // buf is a copy made by append_async(), freed once written
+    bool owned;
+};
+
+static int dir_fd = -1;
+static int commit_efd = -1;
+// Set by the commit thread before the bytes they hold are published
+static int seg_fd[WAL_MAX_SEGMENTS];
+static long interval_us;
+
+static _Atomic size_t committed;
+// Everything below is guarded by lock
+static size_t total;
+static struct wal_req *pending;
+static size_t npending, pending_cap;
+static size_t pending_bytes;
+// The commit thread's batch, swapped with pending so appends never wait on the disk to queue
+static struct wal_req *batch;
+static size_t batch_cap;
+static bool stopping;
+static bool failed;
+static pthread_t commit_thread;
+static bool commit_started;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+// Open or create segment seg; a new file is made durable in the directory too
+static int wal_segment(size_t seg, bool create) {
+    char name[32];
+
+    if (seg >= WAL_MAX_SEGMENTS) {
+        syslog(LOG_ERR, "Log is full at %d segments", WAL_MAX_SEGMENTS);
+        return -1;
+    }
+    if (seg_fd[seg] >= 0) return seg_fd[seg];
+
+    snprintf(name, sizeof(name), "wal-%08zu.log", seg);
+    int fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        if (errno != ENOENT || create) syslog(LOG_ERR, "Opening log segment %s failed: %s", name, strerror(errno));
+        return -1;
+    }
+    if (create && fsync(dir_fd) < 0) {
+        syslog(LOG_ERR, "Syncing %s failed: %s", WAL_DIR, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    seg_fd[seg] = fd;
+    return fd;
+}
+
+// pwritev() that finishes short writes
+static int wal_pwritev(int fd, struct iovec *iov, int cnt, off_t off) {
+    while (cnt > 0) {
+        ssize_t n = pwritev(fd, iov, cnt, off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Write the n queued packets at history position pos and make them durable
+static int wal_write(const struct wal_req *reqs, size_t n, size_t pos) {
+    struct iovec iov[WAL_IOV];
+    size_t first = pos / WAL_SEGMENT_BYTES;
+    size_t i = 0, done = 0;
+
+    while (i < n) {
+        size_t seg = pos / WAL_SEGMENT_BYTES;
+        size_t room = WAL_SEGMENT_BYTES - pos % WAL_SEGMENT_BYTES;
+        size_t bytes = 0;
+        int cnt = 0;
+        int fd = wal_segment(seg, true);
+
+        if (fd < 0) return -1;
+        // One pwritev() per segment, split where a packet crosses into the next one
+        while (i < n && cnt < WAL_IOV && bytes < room) {
+            size_t len = reqs[i].len - done;
+            if (len > room - bytes) len = room - bytes;
+            iov[cnt].iov_base = (char*)reqs[i].buf + done;
+            iov[cnt].iov_len = len;
+            cnt++;
+            bytes += len;
+            done += len;
+            if (done == reqs[i].len) {
+                i++;
+                done = 0;
+            }
+        }
+        if (wal_pwritev(fd, iov, cnt, pos % WAL_SEGMENT_BYTES) < 0) {
+            syslog(LOG_ERR, "Log write failed: %s", strerror(errno));
+            return -1;
+        }
+        pos += bytes;
+    }
+
+    for (size_t seg = first; seg * WAL_SEGMENT_BYTES < pos; seg++) {
+        if (fdatasync(seg_fd[seg]) < 0) {
+            syslog(LOG_ERR, "Log sync failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Caller holds lock; forget the queued packets, freeing the copies among them
+static void wal_drop_pending(void) {
+    for (size_t i = 0; i < npending; i++) {
+        if (pending[i].owned) free((char*)pending[i].buf);
+    }
+    npending = 0;
+    pending_bytes = 0;
+}
+
+static void* wal_commit(void* arg) {
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!stopping && npending == 0) {
+            pthread_cond_wait(&work_cond, &lock);
+        }
+        if (npending == 0) break;
+
+        // Give other clients the interval to join the batch, unless it is already large
+        if (interval_us > 0 && !stopping && pending_bytes < WAL_BATCH_BYTES) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += interval_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (!stopping && pending_bytes < WAL_BATCH_BYTES &&
+                   pthread_cond_timedwait(&work_cond, &lock, &deadline) == 0) {
+            }
+        }
+
+        struct wal_req *reqs = pending;
+        size_t n = npending, cap = pending_cap;
+        size_t start = atomic_load_explicit(&committed, memory_order_relaxed);
+        size_t end = total;
+        pending = batch;
+        pending_cap = batch_cap;
+        batch = reqs;
+        batch_cap = cap;
+        npending = 0;
+        pending_bytes = 0;
+        pthread_mutex_unlock(&lock);
+
+        int rc = wal_write(reqs, n, start);
+        for (size_t i = 0; i < n; i++) {
+            if (reqs[i].owned) free((char*)reqs[i].buf);
+        }
+
+        pthread_mutex_lock(&lock);
+        if (rc < 0) {
+            // Nothing more is written once the log may have a hole
+            failed = true;
+            wal_drop_pending();
+            pthread_cond_broadcast(&done_cond);
+            eventfd_write(commit_efd, 1);
+            break;
+        }
+        atomic_store_explicit(&committed, end, memory_order_release);
+        stats_add(STAT_WAL_COMMITS, 1);
+        pthread_cond_broadcast(&done_cond);
+        eventfd_write(commit_efd, 1);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Copy up to len committed bytes from off, across segments
+static ssize_t wal_pread(char *buf, size_t off, size_t len) {
+    size_t copied = 0;
+
+    while (copied < len) {
+        size_t seg = off / WAL_SEGMENT_BYTES;
+        size_t in_seg = off % WAL_SEGMENT_BYTES;
+        size_t want = len - copied;
+        if (want > WAL_SEGMENT_BYTES - in_seg) want = WAL_SEGMENT_BYTES - in_seg;
+
+        ssize_t got = pread(seg_fd[seg], buf + copied, want, in_seg);
+        if (got <= 0) return copied ? (ssize_t)copied : -1;
+        copied += got;
+        off += got;
+    }
+    return copied;
+}
+
+/**
+ * Drop a torn tail left by a crash during a write: packets end with a
+ * newline, so cut the log after the last one. Nothing past it was
+ * acknowledged to a client.
+ */
+static int wal_trim(size_t nseg) {
+    char chunk[SCAN_CHUNK];
+    size_t end = total;
+
+    while (end > 0) {
+        size_t from = end > SCAN_CHUNK ? end - SCAN_CHUNK : 0;
+        ssize_t got = wal_pread(chunk, from, end - from);
+        if (got != (ssize_t)(end - from)) return -1;
+        char *nl = memrchr(chunk, '\n', got);
+        if (nl) {
+            end = from + (nl - chunk) + 1;
+            break;
+        }
+        end = from;
+    }
+    if (end == total) return 0;
+
+    syslog(LOG_INFO, "Dropping %zu bytes of an unfinished packet from the log", total - end);
+    for (size_t seg = nseg; seg-- > 0;) {
+        size_t base = seg * WAL_SEGMENT_BYTES;
+        char name[32];
+
+        if (base < end || (base == 0 && end == 0)) {
+            if (ftruncate(seg_fd[seg], end - base) < 0 || fsync(seg_fd[seg]) < 0) return -1;
+            break;
+        }
+        snprintf(name, sizeof(name), "wal-%08zu.log", seg);
+        close(seg_fd[seg]);
+        seg_fd[seg] = -1;
+        if (unlinkat(dir_fd, name, 0) < 0) return -1;
+    }
+    total = end;
+    return fsync(dir_fd);
+}
+
+// Reopen the existing segments, so the history survives restarts and crashes
+static int wal_recover(void) {
+    size_t nseg = 0;
+    struct stat st;
+
+    total = 0;
+    while (nseg < WAL_MAX_SEGMENTS && wal_segment(nseg, false) >= 0) {
+        if (fstat(seg_fd[nseg], &st) < 0) return -1;
+        nseg++;
+        total += st.st_size;
+        // Only the newest segment may be partly filled
+        if ((size_t)st.st_size < WAL_SEGMENT_BYTES) break;
+        if ((size_t)st.st_size > WAL_SEGMENT_BYTES) {
+            syslog(LOG_ERR, "Log segment %zu is larger than a segment", nseg - 1);
+            return -1;
+        }
+    }
+    if (nseg > 0 && wal_trim(nseg) < 0) {
+        syslog(LOG_ERR, "Trimming the log failed: %s", strerror(errno));
+        return -1;
+    }
+    if (total > 0) syslog(LOG_INFO, "Recovered %zu bytes of history from %s", total, WAL_DIR);
+    return 0;
+}
+
+static int wal_open(const struct store_config *cfg) {
+    interval_us = cfg->wal_interval_us;
+    for (size_t i = 0; i < WAL_MAX_SEGMENTS; i++) {
+        seg_fd[i] = -1;
+    }
+
+    if (mkdir(WAL_DIR, 0755) < 0 && errno != EEXIST) {
+        syslog(LOG_ERR, "Creating %s failed: %s", WAL_DIR, strerror(errno));
+        return -1;
+    }
+    dir_fd = open(WAL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        syslog(LOG_ERR, "Opening %s failed: %s", WAL_DIR, strerror(errno));
+        return -1;
+    }
+    if (wal_recover() < 0) return -1;
+    atomic_store(&committed, total);
+
+    commit_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (commit_efd < 0) {
+        syslog(LOG_ERR, "eventfd failed");
+        return -1;
+    }
+
+    stopping = failed = false;
+    if (pthread_create(&commit_thread, NULL, wal_commit, NULL) != 0) {
+        syslog(LOG_ERR, "Log commit thread creation failed");
+        return -1;
+    }
+    commit_started = true;
+    return 0;
+}
+
+// Caller holds lock
+static int wal_reserve(void) {
+    if (npending < pending_cap) return 0;
+
+    size_t cap = pending_cap ? pending_cap * 2 : 64;
+    struct wal_req *reqs = realloc(pending, cap * sizeof(*reqs));
+    if (!reqs) return -1;
+    pending = reqs;
+    pending_cap = cap;
+    return 0;
+}
+
+// Caller holds lock and has reserved room; returns where the packet ends
+static size_t wal_queue(const char *buf, size_t len, bool owned) {
+    pending[npending++] = (struct wal_req){ buf, len, owned };
+    pending_bytes += len;
+    total += len;
+    if (npending == 1 || pending_bytes >= WAL_BATCH_BYTES) pthread_cond_signal(&work_cond);
+    return total;
+}
+
+// Sleeps until the batch holding the packet is durable; buf must stay valid until then
+static int wal_append(const char *buf, size_t len, size_t *end) {
+    stats_lock(&lock);
+    if (failed || wal_reserve() < 0) {
+        syslog(LOG_ERR, failed ? "Log is unusable after a write error" : "Log queue allocation failed");
+        *end = atomic_load_explicit(&committed, memory_order_relaxed);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    size_t mine = wal_queue(buf, len, false);
+
+    while (!failed && atomic_load_explicit(&committed, memory_order_relaxed) < mine) {
+        pthread_cond_wait(&done_cond, &lock);
+    }
+    // The reply ends with this packet, even when later ones were committed with it
+    int rc = atomic_load_explicit(&committed, memory_order_relaxed) >= mine ? 0 : -1;
+    *end = rc == 0 ? mine : atomic_load_explicit(&committed, memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+// Queues a copy, so the caller may reuse buf and go on serving other clients
+static int wal_append_async(const char *buf, size_t len, size_t *end) {
+    char *copy = malloc(len);
+
+    stats_lock(&lock);
+    if (failed || !copy || wal_reserve() < 0) {
+        syslog(LOG_ERR, failed ? "Log is unusable after a write error" : "Log queue allocation failed");
+        *end = atomic_load_explicit(&committed, memory_order_relaxed);
+        pthread_mutex_unlock(&lock);
+        free(copy);
+        return -1;
+    }
+    memcpy(copy, buf, len);
+    *end = wal_queue(copy, len, true);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static int wal_durable(size_t end) {
+    int rc;
+
+    if (atomic_load_explicit(&committed, memory_order_acquire) >= end) return 1;
+    pthread_mutex_lock(&lock);
+    rc = atomic_load_explicit(&committed, memory_order_relaxed) >= end ? 1 : failed ? -1 : 0;
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+static int wal_commit_fd(void) {
+    return commit_efd;
+}
+
+static size_t wal_snapshot(void) {
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+static ssize_t wal_send(int sock, size_t off, size_t end) {
+    char chunk[SEND_CHUNK];
+    size_t want = end - off;
+
+    if (want > sizeof(chunk)) want = sizeof(chunk);
+    ssize_t got = wal_pread(chunk, off, want);
+    if (got <= 0) {
+        syslog(LOG_ERR, "Log read failed");
+        return -1;
+    }
+    return send(sock, chunk, got, MSG_NOSIGNAL);
+}
+
+static ssize_t wal_read(char *buf, size_t *off, size_t len) {
+    return wal_pread(buf, *off, len);
+}
+
+// Replies go out in several send() calls; without this the last one waits for a delayed ACK
+static void wal_attach(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void wal_close(void) {
+    if (dir_fd < 0) return;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+    // A failed open leaves no commit thread to join
+    if (commit_started) pthread_join(commit_thread, NULL);
+    commit_started = false;
+
+    for (size_t i = 0; i < WAL_MAX_SEGMENTS; i++) {
+        if (seg_fd[i] >= 0) close(seg_fd[i]);
+        seg_fd[i] = -1;
+    }
+    close(dir_fd);
+    dir_fd = -1;
+    if (commit_efd >= 0) close(commit_efd);
+    commit_efd = -1;
+    wal_drop_pending();
+    free(pending);
+    free(batch);
+    pending = batch = NULL;
+    npending = pending_cap = batch_cap = pending_bytes = total = 0;
+    atomic_store(&committed, 0);
+}
+
+const struct store_ops wal_store_ops = {
+    .name = "wal",
+    .open = wal_open,
+    .append = wal_append,
+    .send = wal_send,
+    .snapshot = wal_snapshot,
+    .read = wal_read,
+    .attach = wal_attach,
+    .append_async = wal_append_async,
+    .durable = wal_durable,
+    .commit_fd = wal_commit_fd,
+    .close = wal_close,
+};
@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <poll.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "store.h"
+#include "framer.h"
+#include "log.h"
+#include "stats.h"
+
+#define RING_ENTRIES 256
+// Provided receive buffers the kernel picks from as data arrives
+#define RECV_BUFS 256
+#define RECV_BUF_SIZE 4096
+#define RECV_BGID 0
+#define SEND_BUF_SIZE (64 * 1024)
+
+// Operation kind, kept in the low bits of user_data next to the conn pointer
+enum uop {
+    UOP_ACCEPT = 1,
+    UOP_RECV,
+    UOP_SEND,
+    UOP_WAKE,
+    UOP_COMMIT,
+};
+#define UOP_MASK 7UL
+
+struct uconn {
+    int fd;
+    struct framer in;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t reply_off;
+    size_t reply_end;
+    uint64_t reply_start;
+    bool replying;
+    // The packet is queued with append_async(); nothing is in flight until durable()
+    bool waiting;
+    bool compress;
+    struct zreply z;
+    LIST_ENTRY(uconn) entries;
+};
+
+LIST_HEAD(uconn_list, uconn);
+
+struct ring {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned pending;
+    struct io_uring_buf_ring *bufs;
+    char *buf_mem;
+    size_t buf_ring_size;
+    unsigned long enters;
+    unsigned long requests;
+    bool multishot_accept;
+};
+
+static struct ring ring = { .fd = -1 };
+static struct uconn_list uconns;
+
+static int ring_enter(unsigned submit, unsigned wait) {
+    ring.enters++;
+    return (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int ring_setup(void) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd < 0) return -1;
+
+    ring.entries = p.sq_entries;
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) return -1;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) return -1;
+
+    char *sq = ring.sq_ptr;
+    char *cq = ring.cq_ptr;
+    ring.sq_head = (_Atomic unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (_Atomic unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head = (_Atomic unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (_Atomic unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Register a ring of provided buffers so recv needs no buffer per connection
+static int ring_setup_bufs(void) {
+    struct io_uring_buf_reg reg;
+
+    ring.buf_ring_size = RECV_BUFS * sizeof(struct io_uring_buf);
+    ring.bufs = mmap(NULL, ring.buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.bufs == MAP_FAILED) {
+        ring.bufs = NULL;
+        return -1;
+    }
+    ring.buf_mem = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+    if (!ring.buf_mem) return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.bufs;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    for (unsigned short bid = 0; bid < RECV_BUFS; bid++) {
+        struct io_uring_buf *b = &ring.bufs->bufs[bid];
+        b->addr = (unsigned long)(ring.buf_mem + (size_t)bid * RECV_BUF_SIZE);
+        b->len = RECV_BUF_SIZE;
+        b->bid = bid;
+    }
+    atomic_store_explicit((_Atomic unsigned short*)&ring.bufs->tail, RECV_BUFS, memory_order_release);
+    return 0;
+}
+
+// Hand a consumed receive buffer back to the kernel
+static void ring_recycle(unsigned short bid) {
+    _Atomic unsigned short *tail = (_Atomic unsigned short*)&ring.bufs->tail;
+    unsigned short t = atomic_load_explicit(tail, memory_order_relaxed);
+    struct io_uring_buf *b = &ring.bufs->bufs[t & (RECV_BUFS - 1)];
+
+    b->addr = (unsigned long)(ring.buf_mem + (size_t)bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    atomic_store_explicit(tail, t + 1, memory_order_release);
+}
+
+static void ring_teardown(void) {
+    if (ring.fd >= 0) close(ring.fd);
+    if (ring.sqes && ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_ptr && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+    if (ring.sq_ptr && ring.sq_ptr != MAP_FAILED) munmap(ring.sq_ptr, ring.sq_size);
+    if (ring.bufs) munmap(ring.bufs, ring.buf_ring_size);
+    free(ring.buf_mem);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+// Next free submission slot, flushing the queue to the kernel when it is full
+static struct io_uring_sqe *ring_sqe(void) {
+    unsigned tail = atomic_load_explicit(ring.sq_tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(ring.sq_head, memory_order_acquire) >= ring.entries) {
+        ring_enter(ring.pending, 0);
+        ring.pending = 0;
+    }
+
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    atomic_store_explicit(ring.sq_tail, tail + 1, memory_order_release);
+    ring.pending++;
+    return sqe;
+}
+
+static void submit_accept(void) {
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (ring.multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UOP_ACCEPT;
+}
+
+static void submit_recv(struct uconn *c) {
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BGID;
+    sqe->user_data = (unsigned long)c | UOP_RECV;
+}
+
+static void submit_send(struct uconn *c) {
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)(c->out + c->out_off);
+    sqe->len = c->out_len - c->out_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)c | UOP_SEND;
+}
+
+static void submit_wake(void) {
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UOP_WAKE;
+}
+
+// Wait for the store's next commit; on_commit() drains the eventfd before waiting again
+static void submit_commit_wait(void) {
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = store->commit_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UOP_COMMIT;
+}
+
+static void uconn_close(struct uconn *c) {
+    close(c->fd);
+    log_event(LOG_INFO, "Close connection on fd %d", c->fd);
+    LIST_REMOVE(c, entries);
+    framer_release(&c->in);
+    zreply_release(&c->z);
+    free(c->out);
+    free(c);
+}
+
+// Start replying with the range committed for the last packet
+static bool uconn_reply(struct uconn *c) {
+    if (c->compress && compress_reply(&c->z, c->reply_off, c->reply_end) < 0) {
+        log_event(LOG_ERR, "Compressing reply failed");
+        return false;
+    }
+    c->replying = true;
+    return true;
+}
+
+// Queue the next operation for a connection; exactly one is in flight at a time
+static void uconn_advance(struct uconn *c) {
+    const char *pkt;
+    size_t pkt_len;
+
+    if (!c->replying && framer_next(&c->in, &pkt, &pkt_len)) {
+        c->reply_start = stats_now();
+        stats_add(STAT_PACKETS, 1);
+        int rc = commit_packet(pkt, pkt_len, &c->reply_off, &c->reply_end, &c->compress, true);
+        if (rc < 0 || (rc == 0 && !uconn_reply(c))) {
+            uconn_close(c);
+            return;
+        }
+        if (rc == 1) {
+            c->waiting = true;
+            return;
+        }
+    }
+
+    if (!c->replying) {
+        submit_recv(c);
+        return;
+    }
+
+    if (c->out_off == c->out_len && c->compress) {
+        // The frames are already built; stage the next part of them
+        size_t n = c->z.len - c->z.sent;
+        if (n > SEND_BUF_SIZE) n = SEND_BUF_SIZE;
+        memcpy(c->out, c->z.buf + c->z.sent, n);
+        c->out_len = n;
+        c->out_off = 0;
+    } else if (c->out_off == c->out_len) {
+        ssize_t got = 0;
+
+        // A bounded store may skip dropped history without copying anything
+        while (got == 0 && c->reply_off < c->reply_end) {
+            size_t from = c->reply_off;
+            size_t want = c->reply_end - c->reply_off;
+            if (want > SEND_BUF_SIZE) want = SEND_BUF_SIZE;
+            got = store->read(c->out, &c->reply_off, want);
+            if (got < 0 || (got == 0 && c->reply_off == from)) {
+                syslog(LOG_ERR, "Read failed");
+                uconn_close(c);
+                return;
+            }
+        }
+        if (got == 0) {
+            c->replying = false;
+            stats_reply_done(c->reply_start);
+            uconn_advance(c);
+            return;
+        }
+        c->out_len = got;
+        c->out_off = 0;
+    }
+    submit_send(c);
+}
+
+static void on_accept(struct io_uring_cqe *cqe) {
+    if (cqe->res == -EINVAL && ring.multishot_accept) {
+        // Kernels before 5.19 reject multishot accept, re-arm one at a time instead
+        ring.multishot_accept = false;
+    } else if (cqe->res < 0 && running) {
+        syslog(LOG_ERR, "Accept failed: %s", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && running) submit_accept();
+    if (cqe->res < 0) return;
+
+    struct uconn *c = calloc(1, sizeof(struct uconn));
+    char *out = malloc(SEND_BUF_SIZE);
+    if (!c || !out) {
+        syslog(LOG_ERR, "Connection allocation failed");
+        close(cqe->res);
+        free(c);
+        free(out);
+        return;
+    }
+    c->fd = cqe->res;
+    c->out = out;
+    framer_init(&c->in);
+    LIST_INSERT_HEAD(&uconns, c, entries);
+    if (store->attach) store->attach(c->fd);
+    stats_add(STAT_CONNECTIONS, 1);
+    log_event(LOG_INFO, "Accepted connection from port %d", PORT);
+    submit_recv(c);
+}
+
+static void on_recv(struct uconn *c, struct io_uring_cqe *cqe) {
+    if (cqe->res == -ENOBUFS) {
+        // Every provided buffer is queued in a framer somewhere; try again
+        submit_recv(c);
+        return;
+    }
+    if (cqe->res <= 0) {
+        if (cqe->res < 0) log_event(LOG_ERR, "Receive failed: %s", strerror(-cqe->res));
+        uconn_close(c);
+        return;
+    }
+
+    stats_add(STAT_BYTES_IN, cqe->res);
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    const char *data = ring.buf_mem + (size_t)bid * RECV_BUF_SIZE;
+    size_t left = cqe->res;
+
+    while (left > 0) {
+        size_t avail;
+        char *space = framer_space(&c->in, &avail);
+        if (!space) {
+            log_event(LOG_ERR, "Receive buffer allocation failed");
+            ring_recycle(bid);
+            uconn_close(c);
+            return;
+        }
+        if (avail > left) avail = left;
+        memcpy(space, data, avail);
+        framer_fill(&c->in, avail);
+        data += avail;
+        left -= avail;
+    }
+    ring_recycle(bid);
+    uconn_advance(c);
+}
+
+static void on_send(struct uconn *c, struct io_uring_cqe *cqe) {
+    if (cqe->res < 0) {
+        log_send_failure(-cqe->res);
+        uconn_close(c);
+        return;
+    }
+
+    stats_add(STAT_BYTES_OUT, cqe->res);
+    c->out_off += cqe->res;
+    if (c->out_off == c->out_len) {
+        bool done;
+        if (c->compress) {
+            c->z.sent += c->out_len;
+            done = c->z.sent == c->z.len;
+        } else {
+            c->reply_off += c->out_len;
+            done = c->reply_off == c->reply_end;
+        }
+        c->out_off = c->out_len = 0;
+        if (done) {
+            c->replying = false;
+            stats_reply_done(c->reply_start);
+        }
+    }
+    uconn_advance(c);
+}
+
+// Resume the connections whose queued packets a store commit made durable
+static void on_commit(struct io_uring_cqe *cqe) {
+    struct uconn *c = LIST_FIRST(&uconns);
+    eventfd_t commits;
+
+    if (cqe->res < 0) {
+        syslog(LOG_ERR, "Waiting for store commits failed: %s", strerror(-cqe->res));
+        return;
+    }
+    eventfd_read(store->commit_fd(), &commits);
+
+    while (c) {
+        struct uconn *next = LIST_NEXT(c, entries);
+        int rc = c->waiting ? store->durable(c->reply_end) : 0;
+        if (rc != 0) {
+            c->waiting = false;
+            if (rc < 0 || !uconn_reply(c)) {
+                uconn_close(c);
+            } else {
+                uconn_advance(c);
+            }
+        }
+        c = next;
+    }
+    submit_commit_wait();
+}
+
+int run_uring(void) {
+    if (ring_setup() < 0 || ring_setup_bufs() < 0) {
+        syslog(LOG_INFO, "io_uring unavailable (%s), using the threaded engine", strerror(errno));
+        ring_teardown();
+        return 1;
+    }
+
+    LIST_INIT(&uconns);
+    ring.multishot_accept = true;
+    submit_accept();
+    submit_wake();
+    if (store->commit_fd) submit_commit_wait();
+
+    while (running) {
+        int rc = ring_enter(ring.pending, 1);
+        if (rc < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        if (rc >= 0) ring.pending -= rc;
+
+        unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct uconn *c = (struct uconn*)(unsigned long)(cqe->user_data & ~UOP_MASK);
+
+            ring.requests++;
+            switch (cqe->user_data & UOP_MASK) {
+                case UOP_ACCEPT:
+                    on_accept(cqe);
+                    break;
+                case UOP_RECV:
+                    on_recv(c, cqe);
+                    break;
+                case UOP_SEND:
+                    on_send(c, cqe);
+                    break;
+                case UOP_WAKE:
+                    running = 0;
+                    break;
+                case UOP_COMMIT:
+                    on_commit(cqe);
+                    break;
+            }
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+    }
+
+    syslog(LOG_INFO, "io_uring engine: %lu completions in %lu io_uring_enter calls",
+           ring.requests, ring.enters);
+
+    struct uconn *c;
+    while ((c = LIST_FIRST(&uconns)) != NULL) {
+        uconn_close(c);
+    }
+    ring_teardown();
+    return 0;
+}
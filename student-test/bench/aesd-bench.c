@@ -0,0 +1,547 @@
+/**
+ * @file aesd-bench.c
+ * @brief Microbenchmarks for the circular buffer, the threading and systemcalls examples and
+ * aesdsocket's LZ4 block codec, reported as JSON
+ *
+ * Each benchmark doubles its iteration count until a run takes at least the minimum time, then
+ * reports the time per iteration.  The output follows Google Benchmark's JSON layout, so two
+ * runs can be compared with its tools/compare.py or any JSON diff:
+ *   aesd-bench [-o file] [-m min-seconds] [-f name-prefix]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "aesd-circular-buffer.h"
+#include "threading.h"
+#include "systemcalls.h"
+#include "lz4block.h"
+
+#define OFFSETS 4096
+#define PAYLOAD 256
+#define BATCH 8
+
+struct timing {
+    double real_ns;
+    double cpu_ns;
+};
+
+struct bench {
+    const char *name;
+    const char *pattern;
+    /* Entries in the buffer, or megabytes of heap held by the parent for spawn benchmarks */
+    size_t size;
+    /* Runs iters iterations after any setup, returning the time they took */
+    struct timing (*run)(struct bench *b, size_t iters);
+    /* Items processed per iteration, reported as items_per_second when set */
+    unsigned items;
+};
+
+static volatile size_t sink;
+static char payload[PAYLOAD];
+static char *heap;
+static size_t heap_mb;
+
+static double clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct timing timer_start(void)
+{
+    struct timing t = { clock_ns(CLOCK_MONOTONIC), clock_ns(CLOCK_PROCESS_CPUTIME_ID) };
+    return t;
+}
+
+static struct timing timer_stop(struct timing start)
+{
+    struct timing t = { clock_ns(CLOCK_MONOTONIC) - start.real_ns,
+                        clock_ns(CLOCK_PROCESS_CPUTIME_ID) - start.cpu_ns };
+    return t;
+}
+
+static uint32_t next_rand(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Set up an empty buffer of @param entries entries in storage allocated here
+ */
+static void alloc_buffer(struct aesd_circular_buffer *buffer, size_t entries)
+{
+    size_t slots = AESD_CIRCULAR_BUFFER_SLOTS(entries);
+
+    if (aesd_circular_buffer_init_storage(buffer, calloc(slots, sizeof(struct aesd_buffer_entry)),
+                                          calloc(slots, sizeof(size_t)), slots, entries) != 0) {
+        fprintf(stderr, "Cannot set up a buffer of %zu entries\n", entries);
+        exit(1);
+    }
+}
+
+/**
+ * Set up a full buffer of @param entries entries with sizes between 1 and PAYLOAD - 1
+ * @return the buffer's total size in bytes
+ */
+static size_t fill_buffer(struct aesd_circular_buffer *buffer, size_t entries)
+{
+    uint32_t rng = 12345;
+    size_t total = 0;
+
+    alloc_buffer(buffer, entries);
+    for (size_t i = 0; i < entries; i++) {
+        struct aesd_buffer_entry entry = { payload, 1 + next_rand(&rng) % (PAYLOAD - 1) };
+        aesd_circular_buffer_add_entry(buffer, &entry);
+        total += entry.size;
+    }
+    return total;
+}
+
+static void free_buffer(struct aesd_circular_buffer *buffer)
+{
+    free(buffer->entry);
+    free(buffer->entry_pos);
+}
+
+static struct timing run_add_entry(struct bench *b, size_t iters)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { payload, 0 };
+    size_t sum = 0;
+    struct timing t;
+
+    fill_buffer(&buffer, b->size);
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++) {
+        entry.size = 1 + (i & 127);
+        sum += aesd_circular_buffer_add_entry(&buffer, &entry).size;
+    }
+    t = timer_stop(t);
+    sink += sum;
+    free_buffer(&buffer);
+    return t;
+}
+
+/* Copies into an arena averaging 64 bytes per entry, so both limits cause evictions */
+static struct timing run_append(struct bench *b, size_t iters)
+{
+    struct aesd_circular_buffer buffer;
+    char *arena = malloc(b->size * 64);
+    size_t sum = 0;
+    struct timing t;
+
+    alloc_buffer(&buffer, b->size);
+    aesd_circular_buffer_init_arena(&buffer, arena, b->size * 64);
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++)
+        sum += aesd_circular_buffer_append(&buffer, payload, 1 + (i & 127)) == 0;
+    t = timer_stop(t);
+    sink += sum;
+    free_buffer(&buffer);
+    free(arena);
+    return t;
+}
+
+static struct timing run_find(struct bench *b, size_t iters)
+{
+    struct aesd_circular_buffer buffer;
+    size_t total = fill_buffer(&buffer, b->size);
+    size_t *offsets = malloc(OFFSETS * sizeof(*offsets));
+    size_t last = buffer.entry_pos[(buffer.in_offs - 1) & buffer.mask] - buffer.entry_pos[buffer.out_offs & buffer.mask];
+    uint32_t rng = 777;
+    size_t byte, sum = 0;
+    struct timing t;
+
+    for (size_t i = 0; i < OFFSETS; i++) {
+        if (strcmp(b->pattern, "sequential") == 0)
+            offsets[i] = i * total / OFFSETS;
+        else if (strcmp(b->pattern, "random") == 0)
+            offsets[i] = next_rand(&rng) % total;
+        else if (strcmp(b->pattern, "oldest") == 0)
+            offsets[i] = 0;
+        else
+            offsets[i] = last;
+    }
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++) {
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i & (OFFSETS - 1)], &byte);
+        sum += byte + (entry != NULL);
+    }
+    t = timer_stop(t);
+    sink += sum;
+    free(offsets);
+    free_buffer(&buffer);
+    return t;
+}
+
+/* Copies the whole history out through read_iov() once per iteration */
+static struct timing run_read_iov(struct bench *b, size_t iters)
+{
+    struct aesd_circular_buffer buffer;
+    size_t total = fill_buffer(&buffer, b->size);
+    struct iovec *iov = malloc(b->size * sizeof(*iov));
+    char *dest = malloc(total);
+    size_t used, sum = 0;
+    struct timing t;
+
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++) {
+        size_t done = 0;
+        aesd_circular_buffer_read_iov(&buffer, 0, total, iov, b->size, &used);
+        for (size_t n = 0; n < used; n++) {
+            memcpy(dest + done, iov[n].iov_base, iov[n].iov_len);
+            done += iov[n].iov_len;
+        }
+        sum += done + (unsigned char)dest[i % total];
+    }
+    t = timer_stop(t);
+    sink += sum;
+    free(dest);
+    free(iov);
+    free_buffer(&buffer);
+    return t;
+}
+
+struct handoff {
+    struct aesd_circular_buffer *buffer;
+    size_t count;
+};
+
+static void *spsc_consumer(void *arg)
+{
+    struct handoff *h = arg;
+    struct aesd_buffer_entry entry;
+    size_t sum = 0;
+
+    for (size_t i = 0; i < h->count;) {
+        if (!aesd_circular_buffer_spsc_pop(h->buffer, &entry)) {
+            sched_yield();
+            continue;
+        }
+        sum += entry.size;
+        i++;
+    }
+    sink += sum;
+    return NULL;
+}
+
+/* One entry per iteration passed to a consumer thread through an SPSC buffer of size entries */
+static struct timing run_spsc(struct bench *b, size_t iters)
+{
+    struct aesd_circular_buffer buffer;
+    struct handoff h = { &buffer, iters };
+    pthread_t consumer;
+    struct timing t;
+
+    alloc_buffer(&buffer, b->size);
+    t = timer_start();
+    pthread_create(&consumer, NULL, spsc_consumer, &h);
+    for (size_t i = 0; i < iters; i++) {
+        struct aesd_buffer_entry entry = { payload, i };
+        while (!aesd_circular_buffer_spsc_push(&buffer, &entry))
+            sched_yield();
+    }
+    pthread_join(consumer, NULL);
+    t = timer_stop(t);
+    free_buffer(&buffer);
+    return t;
+}
+
+/**
+ * One thread from threading.c per iteration: start it, let it take and release the mutex,
+ * join it.  With pattern "contended" the mutex is held while the thread starts, so the cost
+ * includes handing the mutex over to a waiter.
+ */
+static struct timing run_mutex_handoff(struct bench *b, size_t iters)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    bool contended = strcmp(b->pattern, "contended") == 0;
+    size_t ok = 0;
+    struct timing t = timer_start();
+
+    for (size_t i = 0; i < iters; i++) {
+        pthread_t thread;
+        struct thread_data *data;
+
+        if (contended)
+            pthread_mutex_lock(&mutex);
+        if (!start_thread_obtaining_mutex(&thread, &mutex, 0, 0)) {
+            fprintf(stderr, "Cannot start thread\n");
+            exit(1);
+        }
+        if (contended)
+            pthread_mutex_unlock(&mutex);
+        pthread_join(thread, (void **)&data);
+        ok += data->thread_complete_success;
+        free(data);
+    }
+    if (ok != iters) {
+        fprintf(stderr, "%zu of %zu threads failed\n", iters - ok, iters);
+        exit(1);
+    }
+    return timer_stop(t);
+}
+
+/**
+ * Hold a heap of @param mb megabytes, touched so its page tables exist, as in a large service
+ */
+static void set_heap(size_t mb)
+{
+    if (mb == heap_mb)
+        return;
+    free(heap);
+    heap = malloc(mb << 20);
+    if (mb && !heap) {
+        fprintf(stderr, "Cannot allocate a %zu MB heap\n", mb);
+        exit(1);
+    }
+    memset(heap, 1, mb << 20);
+    heap_mb = mb;
+}
+
+/* The fork() and execv() sequence do_exec() used before it moved to posix_spawn() */
+static bool fork_exec(char *const command[])
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        execv(command[0], command);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) == -1)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Run /bin/true once per iteration, or BATCH times concurrently for pattern "do_exec_batch",
+ * with the parent holding b->size megabytes of heap
+ */
+static struct timing run_spawn(struct bench *b, size_t iters)
+{
+    char *command[] = { "/bin/true", NULL };
+    char *const *batch[BATCH];
+    size_t ok = 0, want = iters;
+    struct timing t;
+
+    set_heap(b->size);
+    for (size_t i = 0; i < BATCH; i++)
+        batch[i] = command;
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++) {
+        if (strcmp(b->pattern, "fork_exec") == 0)
+            ok += fork_exec(command);
+        else if (strcmp(b->pattern, "do_exec") == 0)
+            ok += do_exec(1, command[0]);
+        else
+            ok += do_exec_batch(BATCH, batch, NULL);
+    }
+    t = timer_stop(t);
+    if (ok != want) {
+        fprintf(stderr, "%zu of %zu commands failed\n", want - ok, want);
+        exit(1);
+    }
+    return t;
+}
+
+/**
+ * Fill @param buf with @param len bytes of the named corpus: "packets" is aesdsocket history as
+ * loadgen writes it, "text" is log-like lines of words and numbers, "random" does not compress
+ */
+static void fill_corpus(char *buf, size_t len, const char *pattern)
+{
+    static const char *words[] = { "connection", "accepted", "from", "closed", "packet", "bytes",
+                                   "reply", "store", "the", "seek", "history", "error", "to" };
+    uint32_t rng = 4242;
+    size_t pos = 0;
+
+    while (pos < len) {
+        char line[160];
+        int n;
+
+        if (strcmp(pattern, "packets") == 0) {
+            n = snprintf(line, sizeof(line), "c%u s%u xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\n",
+                         next_rand(&rng) % 16, (unsigned)(pos / 56));
+        } else if (strcmp(pattern, "text") == 0) {
+            n = snprintf(line, sizeof(line), "%u %s %s %s %u %s\n", next_rand(&rng) % 100000,
+                         words[next_rand(&rng) % 13], words[next_rand(&rng) % 13],
+                         words[next_rand(&rng) % 13], next_rand(&rng) % 1000, words[next_rand(&rng) % 13]);
+        } else {
+            n = 4;
+            uint32_t r = next_rand(&rng);
+            memcpy(line, &r, 4);
+        }
+        if ((size_t)n > len - pos)
+            n = len - pos;
+        memcpy(buf + pos, line, n);
+        pos += n;
+    }
+}
+
+/* Compress one b->size byte block of the corpus per iteration; items are input bytes */
+static struct timing run_lz4_compress(struct bench *b, size_t iters)
+{
+    char *src = malloc(b->size), *dst = malloc(LZ4_BLOCK_BOUND(b->size));
+    size_t sum = 0;
+    struct timing t;
+
+    fill_corpus(src, b->size, b->pattern);
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++)
+        sum += lz4_compress_block(src, b->size, dst, LZ4_BLOCK_BOUND(b->size));
+    t = timer_stop(t);
+    sink += sum;
+    free(src);
+    free(dst);
+    return t;
+}
+
+/* Decompress the same block back per iteration; items are output bytes */
+static struct timing run_lz4_decompress(struct bench *b, size_t iters)
+{
+    char *src = malloc(b->size), *packed = malloc(LZ4_BLOCK_BOUND(b->size)), *dst = malloc(b->size);
+    size_t comp_len, sum = 0;
+    struct timing t;
+
+    fill_corpus(src, b->size, b->pattern);
+    comp_len = lz4_compress_block(src, b->size, packed, LZ4_BLOCK_BOUND(b->size));
+    t = timer_start();
+    for (size_t i = 0; i < iters; i++)
+        sum += lz4_decompress_block(packed, comp_len, dst, b->size);
+    t = timer_stop(t);
+    if (sum != iters * b->size || memcmp(src, dst, b->size) != 0) {
+        fprintf(stderr, "Decompressed block does not match\n");
+        exit(1);
+    }
+    sink += sum;
+    free(src);
+    free(packed);
+    free(dst);
+    return t;
+}
+
+static struct bench benches[] = {
+    { "add_entry", "overwrite", 10, run_add_entry },
+    { "add_entry", "overwrite", 1024, run_add_entry },
+    { "append", "overwrite", 10, run_append },
+    { "append", "overwrite", 1024, run_append },
+    { "find", "sequential", 10, run_find },
+    { "find", "random", 10, run_find },
+    { "find", "oldest", 10, run_find },
+    { "find", "newest", 10, run_find },
+    { "find", "sequential", 64, run_find },
+    { "find", "random", 64, run_find },
+    { "find", "sequential", 255, run_find },
+    { "find", "random", 255, run_find },
+    { "find", "sequential", 1024, run_find },
+    { "find", "random", 1024, run_find },
+    { "find", "oldest", 1024, run_find },
+    { "find", "newest", 1024, run_find },
+    { "find", "random", 65536, run_find },
+    { "read_iov", "whole", 10, run_read_iov },
+    { "read_iov", "whole", 1024, run_read_iov },
+    { "spsc", "handoff", 1024, run_spsc, 1 },
+    { "mutex_handoff", "uncontended", 1, run_mutex_handoff },
+    { "mutex_handoff", "contended", 1, run_mutex_handoff },
+    { "spawn", "fork_exec", 0, run_spawn, 1 },
+    { "spawn", "do_exec", 0, run_spawn, 1 },
+    { "spawn", "do_exec_batch", 0, run_spawn, BATCH },
+    { "spawn", "fork_exec", 2048, run_spawn, 1 },
+    { "spawn", "do_exec", 2048, run_spawn, 1 },
+    { "spawn", "do_exec_batch", 2048, run_spawn, BATCH },
+    { "lz4_compress", "packets", 65536, run_lz4_compress, 65536 },
+    { "lz4_compress", "text", 65536, run_lz4_compress, 65536 },
+    { "lz4_compress", "random", 65536, run_lz4_compress, 65536 },
+    { "lz4_decompress", "packets", 65536, run_lz4_decompress, 65536 },
+    { "lz4_decompress", "text", 65536, run_lz4_decompress, 65536 },
+    { "lz4_decompress", "random", 65536, run_lz4_decompress, 65536 },
+};
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL, *filter = "";
+    double min_ns = 0.2e9;
+    char date[64];
+    time_t t = time(NULL);
+    FILE *out = stdout;
+    bool first = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:m:f:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'm':
+            min_ns = strtod(optarg, NULL) * 1e9;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o file] [-m min-seconds] [-f name-prefix]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+    fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"num_cpus\": %ld,\n"
+            "    \"library_build_type\": \"%s\"\n  },\n  \"benchmarks\": [",
+            date, sysconf(_SC_NPROCESSORS_ONLN),
+#ifdef NDEBUG
+            "release"
+#else
+            "debug"
+#endif
+            );
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        struct bench *b = &benches[i];
+        char name[128];
+        size_t iters = 1;
+        struct timing elapsed;
+
+        snprintf(name, sizeof(name), "%s/%s/%zu", b->name, b->pattern, b->size);
+        if (strncmp(name, filter, strlen(filter)) != 0)
+            continue;
+        for (;;) {
+            elapsed = b->run(b, iters);
+            if (elapsed.real_ns >= min_ns || iters >= ((size_t)1 << 40))
+                break;
+            iters *= 2;
+        }
+        fprintf(out, "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n"
+                "      \"run_type\": \"iteration\",\n      \"iterations\": %zu,\n"
+                "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"",
+                first ? "" : ",", name, name, iters, elapsed.real_ns / iters, elapsed.cpu_ns / iters);
+        if (b->items)
+            fprintf(out, ",\n      \"items_per_second\": %.1f", b->items * iters * 1e9 / elapsed.real_ns);
+        fprintf(out, "\n    }");
+        fprintf(stderr, "%-32s %12.1f ns %12zu iterations\n", name, elapsed.real_ns / iters, iters);
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+    set_heap(0);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
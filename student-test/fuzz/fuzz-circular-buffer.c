@@ -0,0 +1,315 @@
+/**
+ * @file fuzz-circular-buffer.c
+ * @brief Fuzz target comparing aesd_circular_buffer against a naive model
+ *
+ * The input picks a capacity and mode, then is read as a stream of operations.  After each
+ * operation the buffer must hold exactly the entries the model says it holds, and lookups,
+ * bulk reads and SPSC pops must agree with a linear walk over the model.  Some SPSC inputs are
+ * instead pushed from this thread and popped on another, which must see them in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MAX_CAPACITY 64
+/* Some inputs use twice the minimum slot count */
+#define MAX_SLOTS (2 * AESD_CIRCULAR_BUFFER_SLOTS(MAX_CAPACITY))
+#define MODEL_MAX (MAX_CAPACITY + 1)
+#define POOL_SIZE 4096
+#define HANDOFF_MAX 1024
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+struct model {
+    struct aesd_buffer_entry entry[MODEL_MAX];
+    size_t count;
+};
+
+struct input {
+    const uint8_t *data;
+    size_t len;
+};
+
+struct handoff {
+    struct aesd_circular_buffer *buffer;
+    const struct aesd_buffer_entry *entry;
+    size_t count;
+};
+
+static char pool[POOL_SIZE];
+
+static unsigned next_byte(struct input *in)
+{
+    if (in->len == 0)
+        return 0;
+    in->len--;
+    return *in->data++;
+}
+
+static size_t next_u16(struct input *in)
+{
+    size_t lo = next_byte(in);
+    return lo | (size_t)next_byte(in) << 8;
+}
+
+static void model_drop_oldest(struct model *m)
+{
+    memmove(&m->entry[0], &m->entry[1], (m->count - 1) * sizeof(m->entry[0]));
+    m->count--;
+}
+
+static void model_add(struct model *m, size_t capacity, const struct aesd_buffer_entry *entry)
+{
+    if (m->count == capacity)
+        model_drop_oldest(m);
+    m->entry[m->count++] = *entry;
+}
+
+static size_t model_bytes(const struct model *m)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < m->count; i++)
+        total += m->entry[i].size;
+    return total;
+}
+
+/**
+ * The buffer must hold the model's entries, oldest first.  In arena mode payloads are copies,
+ * so compare bytes instead of pointers.
+ */
+static void check_window(struct aesd_circular_buffer *buffer, const struct model *m, bool arena)
+{
+    CHECK(aesd_circular_buffer_count(buffer) == m->count);
+    for (size_t i = 0; i < m->count; i++) {
+        const struct aesd_buffer_entry *got = &buffer->entry[(buffer->out_offs + i) & buffer->mask];
+        CHECK(got->size == m->entry[i].size);
+        if (arena)
+            CHECK(got->size == 0 || memcmp(got->buffptr, m->entry[i].buffptr, got->size) == 0);
+        else
+            CHECK(got->buffptr == m->entry[i].buffptr);
+    }
+    if (arena)
+        CHECK(model_bytes(m) <= buffer->arena_used && buffer->arena_used <= buffer->arena_size);
+}
+
+static void check_find(struct aesd_circular_buffer *buffer, const struct model *m, size_t offset)
+{
+    size_t byte = 0, start = 0;
+    struct aesd_buffer_entry *got = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &byte);
+
+    for (size_t i = 0; i < m->count; i++) {
+        if (offset < start + m->entry[i].size) {
+            CHECK(got == &buffer->entry[(buffer->out_offs + i) & buffer->mask]);
+            CHECK(byte == offset - start);
+            return;
+        }
+        start += m->entry[i].size;
+    }
+    CHECK(got == NULL);
+}
+
+static void check_read_iov(struct aesd_circular_buffer *buffer, const struct model *m,
+                           size_t offset, size_t len, size_t iovcnt)
+{
+    struct iovec iov[MODEL_MAX];
+    size_t used, done, start = 0, pos = 0, want_iov = 0, want = 0;
+
+    done = aesd_circular_buffer_read_iov(buffer, offset, len, iov, iovcnt, &used);
+    CHECK(used <= iovcnt);
+
+    /* Walk the model's non-empty pieces of [offset, offset + len) in order */
+    for (size_t i = 0; i < m->count && want < len && want_iov < iovcnt; i++) {
+        size_t size = m->entry[i].size;
+        if (size > 0 && offset < start + size) {
+            size_t from = offset > start ? offset - start : 0;
+            size_t chunk = size - from < len - want ? size - from : len - want;
+            CHECK(want_iov < used);
+            CHECK(iov[want_iov].iov_len == chunk);
+            CHECK(memcmp(iov[want_iov].iov_base, m->entry[i].buffptr + from, chunk) == 0);
+            want_iov++;
+            want += chunk;
+        }
+        start += size;
+    }
+    for (size_t i = 0; i < used; i++)
+        pos += iov[i].iov_len;
+    CHECK(used == want_iov);
+    CHECK(done == want && pos == want);
+}
+
+static struct aesd_buffer_entry make_entry(struct input *in)
+{
+    struct aesd_buffer_entry entry;
+    size_t size = next_byte(in);
+    size_t off = next_u16(in) % (POOL_SIZE - size);
+
+    /* Every fourth entry is empty; they must be skipped by lookups */
+    if ((size & 3) == 0)
+        size = 0;
+    entry.buffptr = pool + off;
+    entry.size = size;
+    return entry;
+}
+
+static void *spsc_consumer(void *arg)
+{
+    struct handoff *h = arg;
+    struct aesd_buffer_entry entry;
+
+    for (size_t i = 0; i < h->count;) {
+        if (!aesd_circular_buffer_spsc_pop(h->buffer, &entry)) {
+            sched_yield();
+            continue;
+        }
+        CHECK(entry.buffptr == h->entry[i].buffptr && entry.size == h->entry[i].size);
+        i++;
+    }
+    return NULL;
+}
+
+/**
+ * Push every entry left in @param in while another thread pops them, waiting whenever the
+ * buffer is full
+ */
+static void check_handoff(struct aesd_circular_buffer *buffer, struct input *in)
+{
+    static struct aesd_buffer_entry entries[HANDOFF_MAX];
+    struct handoff h = { buffer, entries, 0 };
+    pthread_t consumer;
+
+    while (in->len > 0 && h.count < HANDOFF_MAX)
+        entries[h.count++] = make_entry(in);
+    CHECK(pthread_create(&consumer, NULL, spsc_consumer, &h) == 0);
+    for (size_t i = 0; i < h.count; i++) {
+        while (!aesd_circular_buffer_spsc_push(buffer, &entries[i]))
+            sched_yield();
+    }
+    CHECK(pthread_join(consumer, NULL) == 0);
+    CHECK(aesd_circular_buffer_count(buffer) == 0);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct aesd_buffer_entry slots[MAX_SLOTS];
+    static size_t positions[MAX_SLOTS];
+    static char arena_mem[POOL_SIZE];
+    static struct model m;
+    struct aesd_circular_buffer buffer;
+    struct input in = { data, size };
+    size_t capacity, arena_size = 0;
+    bool arena, spsc;
+    unsigned config;
+
+    if (pool[0] == 0)
+        for (size_t i = 0; i < POOL_SIZE; i++)
+            pool[i] = (char)(i * 131 + 7);
+
+    config = next_byte(&in);
+    capacity = 1 + next_byte(&in) % MAX_CAPACITY;
+    arena = config & 1;
+    spsc = !arena && (config & 2);
+    CHECK(aesd_circular_buffer_init_storage(&buffer, slots, positions,
+                                            AESD_CIRCULAR_BUFFER_SLOTS(capacity) << (config >> 6 & 1),
+                                            capacity) == 0);
+    if (arena) {
+        arena_size = 1 + next_u16(&in) % POOL_SIZE;
+        CHECK(aesd_circular_buffer_init_arena(&buffer, arena_mem, arena_size) == 0);
+    }
+    m.count = 0;
+    if (spsc && (config & 4)) {
+        check_handoff(&buffer, &in);
+        return 0;
+    }
+
+    while (in.len > 0) {
+        unsigned op = next_byte(&in) % 6;
+        struct aesd_buffer_entry entry, batch[8];
+        size_t n;
+
+        switch (op) {
+        case 0:
+            entry = make_entry(&in);
+            if (arena) {
+                if (entry.size > arena_size) {
+                    CHECK(aesd_circular_buffer_append(&buffer, entry.buffptr, entry.size) != 0);
+                    break;
+                }
+                CHECK(aesd_circular_buffer_append(&buffer, entry.buffptr, entry.size) == 0);
+                model_add(&m, capacity, &entry);
+                /* The arena may evict more than the capacity alone requires, never the new entry */
+                while (m.count > aesd_circular_buffer_count(&buffer))
+                    model_drop_oldest(&m);
+                CHECK(model_bytes(&m) <= arena_size);
+            } else if (spsc) {
+                bool room = m.count < capacity;
+                CHECK(aesd_circular_buffer_spsc_push(&buffer, &entry) == room);
+                if (room)
+                    model_add(&m, capacity, &entry);
+            } else {
+                struct aesd_buffer_entry oldest = m.count == capacity ? m.entry[0] : (struct aesd_buffer_entry){ NULL, 0 };
+                struct aesd_buffer_entry evicted = aesd_circular_buffer_add_entry(&buffer, &entry);
+                CHECK(evicted.buffptr == oldest.buffptr && evicted.size == oldest.size);
+                model_add(&m, capacity, &entry);
+            }
+            break;
+        case 1:
+            n = next_byte(&in) % 9;
+            for (size_t i = 0; i < n; i++)
+                batch[i] = make_entry(&in);
+            if (arena) {
+                /* Entries the arena does not own are refused, which check_window() confirms */
+                aesd_circular_buffer_add_entries(&buffer, batch, n);
+                if (n > 0)
+                    CHECK(aesd_circular_buffer_add_entry(&buffer, &batch[0]).buffptr == NULL);
+                break;
+            }
+            if (spsc) {
+                size_t room = capacity - m.count;
+                size_t added = aesd_circular_buffer_spsc_push_entries(&buffer, batch, n);
+                CHECK(added == (n < room ? n : room));
+                for (size_t i = 0; i < added; i++)
+                    model_add(&m, capacity, &batch[i]);
+            } else {
+                aesd_circular_buffer_add_entries(&buffer, batch, n);
+                for (size_t i = 0; i < n; i++)
+                    model_add(&m, capacity, &batch[i]);
+            }
+            break;
+        case 2:
+            check_find(&buffer, &m, next_u16(&in) % (model_bytes(&m) + 8));
+            break;
+        case 3: {
+            size_t offset = next_u16(&in) % (model_bytes(&m) + 8);
+            size_t len = next_u16(&in);
+            check_read_iov(&buffer, &m, offset, len, 1 + next_byte(&in) % MODEL_MAX);
+            break;
+        }
+        case 4:
+        case 5:
+            if (!spsc)
+                break;
+            if (m.count == 0) {
+                CHECK(!aesd_circular_buffer_spsc_pop(&buffer, &entry));
+                break;
+            }
+            CHECK(aesd_circular_buffer_spsc_pop(&buffer, &entry));
+            CHECK(entry.buffptr == m.entry[0].buffptr && entry.size == m.entry[0].size);
+            model_drop_oldest(&m);
+            break;
+        }
+        check_window(&buffer, &m, arena);
+    }
+    return 0;
+}
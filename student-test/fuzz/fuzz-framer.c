@@ -0,0 +1,90 @@
+/**
+ * @file fuzz-framer.c
+ * @brief Fuzz target for the aesdsocket packet framer
+ *
+ * The input is fed to a framer in pseudo-random recv() sized pieces, draining complete packets
+ * after every piece.  The packets must be exactly the newline terminated runs of the input, in
+ * order, however the stream was split.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "framer.h"
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct framer f;
+    uint32_t rng;
+    unsigned config, repeat;
+    size_t total, fed = 0, checked = 0;
+    char *stream;
+
+    if (size < 3)
+        return 0;
+    config = data[0];
+    rng = (uint32_t)data[1] << 8 | data[2] | 1;
+    data += 3;
+    size -= 3;
+
+    /*
+     * Repeating the input lets short inputs still reach packets larger than FRAMER_BUF, and
+     * mapping low bytes to newlines gives random inputs plenty of short packets.
+     */
+    repeat = 1 + (config & 7);
+    total = size * repeat;
+    stream = malloc(total ? total : 1);
+    CHECK(stream != NULL);
+    for (size_t i = 0; i < total; i++) {
+        char c = (char)data[i % size];
+        if ((config & 8) && (unsigned char)c < 8)
+            c = '\n';
+        stream[i] = c;
+    }
+
+    framer_init(&f);
+    while (fed < total) {
+        size_t avail, n;
+        const char *pkt;
+        size_t len;
+        char *space = framer_space(&f, &avail);
+
+        CHECK(space != NULL && avail > 0);
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        /* Mostly small reads, sometimes as much as fits */
+        n = (config & 16) ? avail : 1 + rng % (rng & 0x100 ? avail : 64);
+        if (n > avail)
+            n = avail;
+        if (n > total - fed)
+            n = total - fed;
+        memcpy(space, stream + fed, n);
+        framer_fill(&f, n);
+        fed += n;
+
+        while (framer_next(&f, &pkt, &len)) {
+            const char *nl = memchr(stream + checked, '\n', fed - checked);
+            CHECK(nl != NULL);
+            CHECK(len == (size_t)(nl - (stream + checked)) + 1);
+            CHECK(memcmp(pkt, stream + checked, len) == 0);
+            checked += len;
+        }
+        /* Nothing left unreturned but an unterminated tail */
+        CHECK(memchr(stream + checked, '\n', fed - checked) == NULL);
+        CHECK(f.len == fed - checked);
+    }
+    framer_release(&f);
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file fuzz-lz4.c
+ * @brief Fuzz target for the aesdsocket LZ4 block codec
+ *
+ * The input is expanded into a compressible block, which must decompress back to itself, and
+ * must either fit or be refused when the output space is cut short.  The raw input is also
+ * decompressed as is, which must fail cleanly or stay within the output space.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "lz4block.h"
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+#define MAX_BLOCK (64 * 1024)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static char block[MAX_BLOCK], packed[LZ4_BLOCK_BOUND(MAX_BLOCK)], out[MAX_BLOCK + 1];
+    uint32_t rng;
+    unsigned config;
+    size_t len = 0, comp_len, cap;
+    ssize_t got;
+
+    if (size < 3)
+        return 0;
+    config = data[0];
+    rng = (uint32_t)data[1] << 8 | data[2] | 1;
+    data += 3;
+    size -= 3;
+
+    /* Arbitrary bytes decode to an error or to at most the space given */
+    got = lz4_decompress_block((const char *)data, size, out, config & 1 ? 64 : MAX_BLOCK);
+    CHECK(got == -1 || (got >= 0 && got <= (config & 1 ? 64 : MAX_BLOCK)));
+
+    /*
+     * Random bytes barely compress, so the block is built from runs of the input copied from
+     * pseudo-random earlier points, which gives matches of every length and distance.
+     */
+    while (size > 0 && len < (size_t)(1 + (config >> 1) % 64) * 1024) {
+        size_t n;
+
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        n = 1 + rng % (rng & 0x100 ? 300 : 16);
+        if (len + n > MAX_BLOCK)
+            n = MAX_BLOCK - len;
+        if (len > 0 && (rng & 0x600)) {
+            size_t from = (rng >> 12) % len;
+            for (size_t i = 0; i < n; i++)
+                block[len + i] = block[from + i];
+        } else {
+            for (size_t i = 0; i < n; i++)
+                block[len + i] = (char)data[(len + i) % size];
+        }
+        len += n;
+    }
+
+    comp_len = lz4_compress_block(block, len, packed, sizeof(packed));
+    CHECK(comp_len > 0 && comp_len <= LZ4_BLOCK_BOUND(len));
+    got = lz4_decompress_block(packed, comp_len, out, MAX_BLOCK + 1);
+    CHECK(got == (ssize_t)len);
+    CHECK(memcmp(out, block, len) == 0);
+
+    /* One byte short of the real size must be refused, never overrun */
+    if (len > 0) {
+        CHECK(lz4_decompress_block(packed, comp_len, out, len - 1) == -1);
+    }
+    cap = rng % (comp_len + 1);
+    comp_len = lz4_compress_block(block, len, packed, cap);
+    CHECK(comp_len <= cap);
+    if (comp_len > 0) {
+        CHECK(lz4_decompress_block(packed, comp_len, out, MAX_BLOCK) == (ssize_t)len);
+        CHECK(memcmp(out, block, len) == 0);
+    }
+    return 0;
+}
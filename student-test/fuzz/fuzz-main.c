@@ -0,0 +1,95 @@
+/**
+ * @file fuzz-main.c
+ * @brief Standalone driver for the fuzz targets when not linked with libFuzzer
+ *
+ * With file arguments each file is run once, which replays a crash or an AFL corpus entry.
+ * Without them random inputs are generated, so the same target runs as a model-based
+ * property test under ctest:
+ *   fuzz-circular-buffer [-n iterations] [-s seed] [-l max-length] [file...]
+ * A file of "-" reads the input from stdin, as AFL's plain mode expects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int run_file(const char *path)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    uint8_t *data = NULL;
+    size_t size = 0, cap = 0, n;
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    do {
+        if (size == cap) {
+            cap = cap ? cap * 2 : 4096;
+            data = realloc(data, cap);
+            if (!data) {
+                perror("realloc");
+                return -1;
+            }
+        }
+        n = fread(data + size, 1, cap - size, fp);
+        size += n;
+    } while (n > 0);
+    if (fp != stdin)
+        fclose(fp);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 10000, seed = 1, max_len = 2048;
+    uint8_t *data;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            max_len = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-s seed] [-l max-length] [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++)
+            if (run_file(argv[i]) != 0)
+                return 1;
+        return 0;
+    }
+
+    data = malloc(max_len ? max_len : 1);
+    if (!data) {
+        perror("malloc");
+        return 1;
+    }
+    srandom(seed);
+    for (unsigned long i = 0; i < iterations; i++) {
+        size_t len = max_len ? (size_t)random() % (max_len + 1) : 0;
+        for (size_t j = 0; j < len; j++)
+            data[j] = (uint8_t)random();
+        LLVMFuzzerTestOneInput(data, len);
+    }
+    printf("%lu random inputs passed (seed %lu)\n", iterations, seed);
+    free(data);
+    return 0;
+}